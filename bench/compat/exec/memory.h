@@ -0,0 +1,7 @@
+#ifndef EXEC_MEMORY_H
+#define EXEC_MEMORY_H
+
+/* Host stand-in, the codec does not allocate */
+#include <exec/types.h>
+
+#endif /* EXEC_MEMORY_H */
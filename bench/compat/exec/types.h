@@ -0,0 +1,21 @@
+#ifndef EXEC_TYPES_H
+#define EXEC_TYPES_H
+
+/* Host stand-in for the Exec base types, sized as on the Amiga */
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t  UBYTE;
+typedef int8_t   BYTE;
+typedef uint16_t UWORD;
+typedef int16_t  WORD;
+typedef uint32_t ULONG;
+typedef int32_t  LONG;
+typedef void    *APTR;
+typedef char    *STRPTR;
+typedef short    BOOL;
+
+#define TRUE  1
+#define FALSE 0
+
+#endif /* EXEC_TYPES_H */
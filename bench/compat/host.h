@@ -0,0 +1,13 @@
+#ifndef BENCH_HOST_H
+#define BENCH_HOST_H
+
+/* Forced into every host build of src/dns.c. bonami.h needs the Amiga
+ * system and socket headers; the codec only uses the definitions below,
+ * which must stay in step with include/bonami.h. */
+#define BONAMI_H
+
+#define BA_OK            0
+#define BA_BADPARAM     -1
+#define BA_MAX_NAME_LEN 256
+
+#endif /* BENCH_HOST_H */
@@ -0,0 +1,7 @@
+#ifndef PROTO_EXEC_H
+#define PROTO_EXEC_H
+
+/* Host stand-in, the codec makes no Exec calls */
+#include <exec/types.h>
+
+#endif /* PROTO_EXEC_H */
@@ -0,0 +1,354 @@
+/* Host benchmark for the DNS codec in src/dns.c.
+ * Runs the parser, name decoder, RDATA iterator and packet writer over a
+ * corpus of mDNS packets and reports packets/sec and ns per record.
+ *
+ * Usage: dns_bench [-n iterations] packet.bin ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <exec/types.h>
+#include "dns.h"
+
+#define MAX_CORPUS 256
+
+struct Packet {
+    const char *file;
+    UBYTE data[MAX_PACKET_SIZE];
+    LONG length;
+};
+
+static struct Packet corpus[MAX_CORPUS];
+static LONG numPackets;
+static struct DNSMessage msg;
+static volatile ULONG sink;  /* Keeps results alive */
+
+/* Monotonic time in nanoseconds */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Load one packet file */
+static int loadPacket(const char *file)
+{
+    struct Packet *packet;
+    FILE *fp;
+
+    if (numPackets >= MAX_CORPUS) {
+        fprintf(stderr, "Too many packets, %s skipped\n", file);
+        return -1;
+    }
+
+    fp = fopen(file, "rb");
+    if (!fp) {
+        perror(file);
+        return -1;
+    }
+
+    packet = &corpus[numPackets];
+    packet->file = file;
+    packet->length = fread(packet->data, 1, sizeof(packet->data), fp);
+    fclose(fp);
+
+    numPackets++;
+    return 0;
+}
+
+/* Flush callback for the writer, the packet is only counted */
+static LONG countPacket(const UBYTE *data, LONG len, APTR userData)
+{
+    sink += data[len - 1] + len;
+    return 0;
+}
+
+/* dnsParseMessage only, returns the records seen */
+static LONG runParse(const struct Packet *packet)
+{
+    if (dnsParseMessage(packet->data, packet->length, &msg) != BA_OK)
+        return 0;
+
+    return msg.numEntries;
+}
+
+/* Parse and decode every owner name through the per-packet cache */
+static LONG runNames(const struct Packet *packet)
+{
+    char name[BA_MAX_NAME_LEN];
+    LONG i;
+
+    if (dnsParseMessage(packet->data, packet->length, &msg) != BA_OK)
+        return 0;
+
+    for (i = 0; i < msg.numEntries; i++) {
+        if (dnsEntryName(&msg, &msg.entries[i], name, sizeof(name)) >= 0)
+            sink += name[0];
+    }
+
+    return msg.numEntries;
+}
+
+/* The older entry points: dnsParseQuestion, dnsParseRecord and
+ * dnsLabelsToName on each entry, without the name cache */
+static LONG runRecords(const struct Packet *packet)
+{
+    char name[BA_MAX_NAME_LEN];
+    struct DNSQuestion q;
+    struct DNSRecord r;
+    struct DNSEntry *entry;
+    LONG i;
+
+    if (dnsParseMessage(packet->data, packet->length, &msg) != BA_OK)
+        return 0;
+
+    q.qname = name;
+    r.name = name;
+    for (i = 0; i < msg.numEntries; i++) {
+        entry = &msg.entries[i];
+        if (entry->section == DNS_SECTION_QUESTION)
+            sink += dnsParseQuestion(packet->data, packet->length, entry->offset, &q);
+        else
+            sink += dnsParseRecord(packet->data, packet->length, entry->offset, &r);
+    }
+
+    /* Names are relative to the message start, so only the first works */
+    if (msg.numEntries > 0)
+        sink += dnsLabelsToName(packet->data + DNS_HEADER_SIZE,
+                                packet->length - DNS_HEADER_SIZE, name, sizeof(name));
+
+    return msg.numEntries;
+}
+
+/* Walk the RDATA of every record */
+static LONG runRData(const struct Packet *packet)
+{
+    struct DNSRDataIter iter;
+    struct DNSRData rd;
+    LONG i;
+
+    if (dnsParseMessage(packet->data, packet->length, &msg) != BA_OK)
+        return 0;
+
+    for (i = 0; i < msg.numEntries; i++) {
+        if (dnsEntryRData(&msg, &msg.entries[i], &iter) < 0)
+            continue;
+        while (dnsRDataNext(&iter, &rd) > 0)
+            sink += rd.length + rd.port;
+    }
+
+    return msg.numEntries;
+}
+
+/* Parse, decode and write the packet back out with compression */
+static LONG runBuild(const struct Packet *packet)
+{
+    struct DNSPacketWriter writer;
+    struct DNSRDataIter iter;
+    struct DNSRData rd;
+    struct DNSQuestion q;
+    struct DNSRecord r;
+    struct DNSEntry *entry;
+    UBYTE buffer[DNS_DEFAULT_BUDGET];
+    UBYTE rdata[BA_MAX_NAME_LEN + 6];
+    char name[BA_MAX_NAME_LEN];
+    char target[BA_MAX_NAME_LEN];
+    LONG n;
+    LONG i;
+
+    if (dnsParseMessage(packet->data, packet->length, &msg) != BA_OK)
+        return 0;
+
+    dnsWriterInit(&writer, buffer, sizeof(buffer), msg.header.flags1, countPacket, NULL);
+    q.qname = name;
+    r.name = name;
+
+    for (i = 0; i < msg.numEntries; i++) {
+        entry = &msg.entries[i];
+        if (dnsEntryName(&msg, entry, name, sizeof(name)) < 0)
+            continue;
+
+        if (entry->section == DNS_SECTION_QUESTION) {
+            q.qtype = entry->type;
+            q.qclass = entry->class;
+            dnsWriterAddQuestion(&writer, &q);
+            continue;
+        }
+
+        r.type = entry->type;
+        r.class = entry->class;
+        r.ttl = entry->ttl;
+        r.rdlength = entry->rdlength;
+        r.rdata = (UBYTE *)packet->data + entry->rdoffset;
+
+        /* Names in RDATA go back to uncompressed labels first */
+        if (entry->type == DNS_TYPE_PTR || entry->type == DNS_TYPE_SRV) {
+            if (dnsEntryRData(&msg, entry, &iter) < 0 || dnsRDataNext(&iter, &rd) <= 0 ||
+                dnsReadName(packet->data, packet->length, rd.name, target, sizeof(target),
+                            &msg.names) < 0)
+                continue;
+            n = (entry->type == DNS_TYPE_SRV) ? 6 : 0;
+            if (n)
+                memcpy(rdata, packet->data + entry->rdoffset, 6);
+            r.rdlength = n + dnsNameToLabels(target, rdata + n, sizeof(rdata) - n);
+            r.rdata = rdata;
+        } else if (entry->type == DNS_TYPE_NSEC) {
+            continue;
+        }
+
+        dnsWriterAddRecord(&writer, entry->section, &r);
+    }
+
+    dnsWriterFlush(&writer);
+    return msg.numEntries;
+}
+
+/* Records of each packet rendered once to wire form, as bonami.c does
+ * for its registered records, for runWire */
+struct WireSet {
+    UBYTE data[MAX_PACKET_SIZE * 2];
+    UWORD offsets[DNS_MAX_ENTRIES];
+    UWORD lengths[DNS_MAX_ENTRIES];
+    UBYTE sections[DNS_MAX_ENTRIES];
+    LONG count;
+};
+
+static struct WireSet wires[MAX_CORPUS];
+
+/* Render the records of a packet with dnsBuildRecord and no name table */
+static void renderWires(const struct Packet *packet, struct WireSet *set)
+{
+    struct DNSRDataIter iter;
+    struct DNSRData rd;
+    struct DNSRecord r;
+    struct DNSEntry *entry;
+    UBYTE rdata[BA_MAX_NAME_LEN + 6];
+    char name[BA_MAX_NAME_LEN];
+    char target[BA_MAX_NAME_LEN];
+    LONG used = 0;
+    LONG n;
+    LONG i;
+
+    set->count = 0;
+    if (dnsParseMessage(packet->data, packet->length, &msg) != BA_OK)
+        return;
+
+    r.name = name;
+    for (i = 0; i < msg.numEntries; i++) {
+        entry = &msg.entries[i];
+        if (entry->section == DNS_SECTION_QUESTION || entry->type == DNS_TYPE_NSEC ||
+            dnsEntryName(&msg, entry, name, sizeof(name)) < 0)
+            continue;
+
+        r.type = entry->type;
+        r.class = entry->class;
+        r.ttl = entry->ttl;
+        r.rdlength = entry->rdlength;
+        r.rdata = (UBYTE *)packet->data + entry->rdoffset;
+
+        if (entry->type == DNS_TYPE_PTR || entry->type == DNS_TYPE_SRV) {
+            if (dnsEntryRData(&msg, entry, &iter) < 0 || dnsRDataNext(&iter, &rd) <= 0 ||
+                dnsReadName(packet->data, packet->length, rd.name, target, sizeof(target),
+                            &msg.names) < 0)
+                continue;
+            n = (entry->type == DNS_TYPE_SRV) ? 6 : 0;
+            if (n)
+                memcpy(rdata, packet->data + entry->rdoffset, 6);
+            r.rdlength = n + dnsNameToLabels(target, rdata + n, sizeof(rdata) - n);
+            r.rdata = rdata;
+        }
+
+        n = dnsBuildRecord(set->data + used, sizeof(set->data) - used, &r, NULL);
+        if (n < 0)
+            continue;
+        set->offsets[set->count] = used;
+        set->lengths[set->count] = n;
+        set->sections[set->count] = entry->section;
+        set->count++;
+        used += n;
+    }
+}
+
+/* Write pre-rendered records with dnsWriterAddWire, no parsing involved */
+static LONG runWire(const struct Packet *packet)
+{
+    const struct WireSet *set = &wires[packet - corpus];
+    struct DNSPacketWriter writer;
+    UBYTE buffer[DNS_DEFAULT_BUDGET];
+    LONG i;
+
+    dnsWriterInit(&writer, buffer, sizeof(buffer), DNS_FLAG_QR | DNS_FLAG_AA,
+                  countPacket, NULL);
+
+    for (i = 0; i < set->count; i++)
+        dnsWriterAddWire(&writer, set->sections[i], set->data + set->offsets[i],
+                         set->lengths[i]);
+
+    dnsWriterFlush(&writer);
+    return set->count;
+}
+
+/* Time one stage over the whole corpus */
+static void runStage(const char *label, LONG (*stage)(const struct Packet *), LONG iterations)
+{
+    double start, elapsed;
+    ULONG records = 0;
+    LONG i, k;
+
+    /* Warm up */
+    for (k = 0; k < numPackets; k++)
+        stage(&corpus[k]);
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        for (k = 0; k < numPackets; k++)
+            records += stage(&corpus[k]);
+    }
+    elapsed = now() - start;
+
+    printf("%-8s %12.0f packets/s %8.1f ns/record\n", label,
+           (double)iterations * numPackets * 1e9 / elapsed,
+           records ? elapsed / records : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    LONG iterations = 20000;
+    LONG good = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atol(argv[++i]);
+        } else {
+            loadPacket(argv[i]);
+        }
+    }
+
+    if (numPackets == 0 || iterations <= 0) {
+        fprintf(stderr, "Usage: %s [-n iterations] packet.bin ...\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < numPackets; i++) {
+        if (dnsParseMessage(corpus[i].data, corpus[i].length, &msg) == BA_OK)
+            good++;
+        renderWires(&corpus[i], &wires[i]);
+    }
+    printf("%ld packets (%ld parse), %ld iterations\n",
+           (long)numPackets, (long)good, (long)iterations);
+
+    runStage("parse", runParse, iterations);
+    runStage("names", runNames, iterations);
+    runStage("records", runRecords, iterations);
+    runStage("rdata", runRData, iterations);
+    runStage("build", runBuild, iterations);
+    runStage("wire", runWire, iterations);
+
+    return 0;
+}
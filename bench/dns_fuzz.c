@@ -0,0 +1,150 @@
+/* Fuzz entry point for the DNS codec in src/dns.c.
+ * Built with -DFUZZ_LIBFUZZER and -fsanitize=fuzzer this is a libFuzzer
+ * target; otherwise main() replays the files given on the command line,
+ * which is how the corpus is checked under the sanitizers.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <exec/types.h>
+#include "dns.h"
+
+static struct DNSMessage msg;
+
+/* Flush callback for the writer, the output is parsed again */
+static LONG reparse(const UBYTE *data, LONG len, APTR userData)
+{
+    static struct DNSMessage again;
+
+    return dnsParseMessage(data, len, &again) == BA_OK ? 0 : -1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct DNSPacketWriter writer;
+    struct DNSRDataIter iter;
+    struct DNSRData rd;
+    struct DNSQuestion q;
+    struct DNSRecord r;
+    struct DNSEntry *entry;
+    UBYTE buffer[512];
+    UBYTE wire[MAX_PACKET_SIZE];
+    UBYTE labels[BA_MAX_NAME_LEN];
+    char name[BA_MAX_NAME_LEN];
+    char target[BA_MAX_NAME_LEN];
+    LONG len = size;
+    LONG n;
+    LONG i;
+
+    if (size > MAX_PACKET_SIZE)
+        return 0;
+
+    /* Raw name decoding at the start of the data */
+    if (len > 0) {
+        dnsLabelsToName(data, len, name, sizeof(name));
+        dnsSkipName(data, len);
+    }
+
+    /* The raw bytes as a pre-rendered record */
+    dnsCopyRecord(wire, sizeof(wire), data, len, NULL);
+
+    if (dnsParseMessage(data, len, &msg) != BA_OK)
+        return 0;
+
+    /* Small budget so the writer splits often */
+    dnsWriterInit(&writer, buffer, sizeof(buffer), msg.header.flags1, reparse, NULL);
+    q.qname = name;
+    r.name = name;
+
+    for (i = 0; i < msg.numEntries; i++) {
+        entry = &msg.entries[i];
+
+        if (entry->section == DNS_SECTION_QUESTION) {
+            dnsParseQuestion(data, len, entry->offset, &q);
+        } else {
+            dnsParseRecord(data, len, entry->offset, &r);
+
+            if (dnsEntryRData(&msg, entry, &iter) == 0) {
+                while (dnsRDataNext(&iter, &rd) > 0) {
+                    if (rd.name >= 0)
+                        dnsReadName(data, len, rd.name, target, sizeof(target), &msg.names);
+                    if (rd.type == DNS_TYPE_NSEC)
+                        dnsNSECHasType(&rd, DNS_TYPE_A);
+                }
+            }
+        }
+
+        if (dnsEntryName(&msg, entry, name, sizeof(name)) < 0)
+            continue;
+
+        /* Names must survive a round trip through the encoder */
+        if (dnsNameToLabels(name, labels, sizeof(labels)) > 0)
+            dnsLabelsHaveSuffix(labels, (const UBYTE *)"\5local");
+        dnsNameHasSuffix(name, "local");
+
+        /* Negative answer for the name, listing the entry's type */
+        n = dnsBuildNSEC(wire, sizeof(wire), name, entry->class, entry->ttl, &entry->type, 1);
+        if (n > 0)
+            dnsWriterAddWire(&writer, DNS_SECTION_ADDITIONAL, wire, n);
+
+        if (entry->section == DNS_SECTION_QUESTION) {
+            q.qtype = entry->type;
+            q.qclass = entry->class;
+            dnsWriterAddQuestion(&writer, &q);
+        } else if (entry->type != DNS_TYPE_PTR && entry->type != DNS_TYPE_SRV) {
+            /* Compressed RDATA names cannot be copied as they are */
+            r.type = entry->type;
+            r.class = entry->class;
+            r.ttl = entry->ttl;
+            r.rdlength = entry->rdlength;
+            r.rdata = (UBYTE *)data + entry->rdoffset;
+            dnsWriterAddRecord(&writer, entry->section, &r);
+
+            /* The same record rendered once and copied back in */
+            n = dnsBuildRecord(wire, sizeof(wire), &r, NULL);
+            if (n > 0)
+                dnsWriterAddWire(&writer, entry->section, wire, n);
+        }
+    }
+
+    dnsWriterFlush(&writer);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+int main(int argc, char **argv)
+{
+    static UBYTE data[MAX_PACKET_SIZE + 1];
+    UBYTE *input;
+    FILE *fp;
+    size_t size;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        fp = fopen(argv[i], "rb");
+        if (!fp) {
+            perror(argv[i]);
+            return 1;
+        }
+        size = fread(data, 1, sizeof(data), fp);
+        fclose(fp);
+
+        /* Exactly size bytes, as libFuzzer passes them, so that reads
+         * past the end are caught by ASan */
+        input = malloc(size ? size : 1);
+        if (!input) {
+            perror("malloc");
+            return 1;
+        }
+        memcpy(input, data, size);
+        LLVMFuzzerTestOneInput(input, size);
+        free(input);
+    }
+
+    printf("%d inputs replayed\n", argc - 1);
+    return 0;
+}
+#endif
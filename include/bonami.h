@@ -32,6 +32,7 @@
 #define BA_NOTREADY       -13 /* Network not ready */
 #define BA_BUSY           -14 /* Operation in progress */
 #define BA_CANCELLED      -15 /* Operation cancelled */
+#define BA_CONFLICT       -16 /* Name already in use on the network */
 
 /* Maximum lengths */
 #define BA_MAX_NAME_LEN    256
@@ -47,9 +48,17 @@
  * Example: _http._tcp.local
  */
 
+struct BAService;
+
 /* Callback type for service updates */
 typedef void (*BAServiceCallback)(struct BAService *service, APTR userData);
 
+/* Callback type for the outcome of a registration: BA_OK once probing
+ * found the name free and announcing starts, BA_CONFLICT if another host
+ * answered for it, in which case the service is dropped again. Called
+ * on the daemon's task, so it must not block. */
+typedef void (*BARegisterCallback)(struct BAService *service, LONG result, APTR userData);
+
 /* Structure for service registration */
 struct BAService {
     char name[BA_MAX_NAME_LEN];
@@ -135,11 +144,13 @@ struct BAMonitor {
     APTR userData;
 };
 
-/* Batch structure */
+/* Batch structure for BARegisterServices */
 struct BABatch {
-    struct BAService *services;
-    ULONG numServices;
+    struct BAService *services;  /* Array of maxServices entries */
+    ULONG numServices;           /* Entries in use */
     ULONG maxServices;
+    BARegisterCallback callback; /* Outcome of each service, or NULL */
+    APTR userData;
 };
 
 /* Interface structure */
@@ -187,6 +198,8 @@ extern "C" {
 
 /* Public API */
 LONG BARegisterService(struct BAService *service);
+LONG BARegisterServiceNotify(struct BAService *service, BARegisterCallback callback, APTR userData);
+LONG BARegisterServices(struct BABatch *batch);
 LONG BAUnregisterService(const char *name, const char *type);
 LONG BAStartDiscovery(struct BADiscovery *discovery);
 LONG BAStopDiscovery(struct BADiscovery *discovery);
@@ -3,6 +3,14 @@
 
 #include <exec/types.h>
 
+/* Message limits */
+#define DNS_HEADER_SIZE  12      /* Size of the wire header */
+#define MAX_PACKET_SIZE  4096    /* Largest datagram we send or accept */
+#define MAX_QUESTIONS    64
+#define MAX_ANSWERS      64
+#define MAX_AUTHORITY    64
+#define MAX_ADDITIONAL   64
+
 /* DNS Message Header */
 struct DNSHeader {
     UWORD id;        /* Identification */
@@ -29,12 +37,69 @@ struct DNSHeader {
 #define DNS_TYPE_A      1    /* Host Address */
 #define DNS_TYPE_PTR   12    /* Domain Name Pointer */
 #define DNS_TYPE_TXT   16    /* Text Strings */
+#define DNS_TYPE_AAAA  28    /* IPv6 Host Address */
 #define DNS_TYPE_SRV   33    /* Server Selection */
+#define DNS_TYPE_NSEC  47    /* Next Secure, mDNS negative answers */
 #define DNS_TYPE_ANY  255    /* Any Type */
 
 /* DNS Class Values */
 #define DNS_CLASS_IN    1    /* Internet */
 #define DNS_CLASS_ANY 255    /* Any Class */
+#define DNS_CLASS_MASK 0x7FFF  /* Class without the mDNS QU/cache-flush bit */
+
+/* Name compression (RFC 1035 4.1.4) */
+#define DNS_MAX_COMPRESS        64      /* Pointer targets remembered per packet */
+#define DNS_MAX_POINTER_OFFSET  0x3FFF  /* Largest offset a pointer can encode */
+#define DNS_MAX_POINTER_HOPS    16      /* Pointers followed before giving up */
+
+/* Label sequences already written to a packet being built */
+struct DNSNameTable {
+    const UBYTE *base;   /* Start of the packet */
+    UWORD count;
+    UWORD offsets[DNS_MAX_COMPRESS];
+};
+
+/* Name decoding */
+#define DNS_MAX_LABELS          128     /* Labels in one name */
+#define DNS_NAME_CACHE_SLOTS    64      /* Must be a power of two */
+#define DNS_NAME_CACHE_SIZE     1024    /* Text remembered per packet */
+
+/* A label position already decoded, and the dotted suffix it starts */
+struct DNSNameSlot {
+    UWORD offset;        /* Packet offset of the label */
+    UWORD wire;          /* Bytes from there to the end of its inline run */
+    UWORD text;          /* Suffix position in DNSNameCache.text */
+    UWORD length;        /* Suffix length, 0 marks an empty slot */
+};
+
+/* Suffixes decoded from one packet, indexed by label offset */
+struct DNSNameCache {
+    struct DNSNameSlot slots[DNS_NAME_CACHE_SLOTS];
+    UWORD used;
+    char text[DNS_NAME_CACHE_SIZE];
+};
+
+/* Message sections */
+#define DNS_SECTION_QUESTION   0
+#define DNS_SECTION_ANSWER     1
+#define DNS_SECTION_AUTHORITY  2
+#define DNS_SECTION_ADDITIONAL 3
+
+#define DNS_MAX_ENTRIES (MAX_QUESTIONS + MAX_ANSWERS + MAX_AUTHORITY + MAX_ADDITIONAL)
+
+/* Location of one question or resource record inside a packet.
+ * Offsets are from the start of the message, so the view stays valid
+ * only as long as the packet buffer does. */
+struct DNSEntry {
+    UWORD offset;        /* Owner name */
+    UWORD rdoffset;      /* RDATA, 0 for questions */
+    UWORD rdlength;      /* RDATA length */
+    UWORD type;          /* Record or question type */
+    UWORD class;         /* Class, including the mDNS top bit */
+    UBYTE section;       /* DNS_SECTION_xxx */
+    UBYTE pad;
+    ULONG ttl;           /* Time to live, 0 for questions */
+};
 
 /* DNS Message Structure */
 struct DNSMessage {
@@ -43,6 +108,11 @@ struct DNSMessage {
     UBYTE *answers;      /* Answer section */
     UBYTE *authority;    /* Authority section */
     UBYTE *additional;   /* Additional section */
+    const UBYTE *data;   /* Packet the entries refer to */
+    LONG length;         /* Packet length */
+    UWORD numEntries;    /* Questions and records, in packet order */
+    struct DNSEntry entries[DNS_MAX_ENTRIES];
+    struct DNSNameCache names;  /* Suffixes decoded by dnsEntryName */
 };
 
 /* DNS Question Structure */
@@ -62,15 +132,112 @@ struct DNSRecord {
     UBYTE *rdata;        /* Record data */
 };
 
+/* Position of an RDATA walk. data/len cover the whole packet so that
+ * compressed names inside the RDATA can be resolved with dnsReadName. */
+struct DNSRDataIter {
+    const UBYTE *data;   /* Packet the RDATA lives in */
+    LONG len;            /* Packet length */
+    LONG pos;            /* Next unread RDATA byte */
+    LONG end;            /* End of the RDATA */
+    LONG next;           /* NSEC next domain name offset */
+    UWORD type;          /* Record type */
+};
+
+/* One typed item of RDATA. Nothing is copied: data points into the
+ * packet and names are offsets to decode with dnsReadName when needed.
+ * A, AAAA, PTR and SRV yield one item, TXT one per string and NSEC one
+ * per type bitmap window. */
+struct DNSRData {
+    UWORD type;          /* Record type */
+    UWORD length;        /* Bytes at data */
+    const UBYTE *data;   /* A/AAAA address, TXT string, NSEC bitmap, other RDATA */
+    LONG name;           /* PTR/SRV target or NSEC next name */
+    UWORD priority;      /* SRV */
+    UWORD weight;        /* SRV */
+    UWORD port;          /* SRV */
+    UBYTE window;        /* NSEC bitmap window */
+    UBYTE pad;
+};
+
+/* Packet writer */
+#define DNS_DEFAULT_BUDGET 1472  /* Ethernet MTU less IPv4 and UDP headers */
+
+/* Called with each finished packet, returns 0 or an error */
+typedef LONG (*DNSFlushFunc)(const UBYTE *data, LONG len, APTR userData);
+
+/* Builds as few packets as possible from questions and records appended
+ * in any order. Each packet stays within budget bytes; when the next item
+ * does not fit, or belongs to an earlier section, the packet is handed to
+ * flush and a new one started. A query split inside its known answers
+ * carries TC (RFC 6762 7.2), other splits do not. */
+struct DNSPacketWriter {
+    UBYTE *buffer;              /* Packet being built, at least budget bytes */
+    LONG budget;                /* Largest packet to produce */
+    LONG length;                /* Bytes used so far */
+    struct DNSHeader header;    /* Flags and counts of the packet being built */
+    UBYTE section;              /* Last section appended to */
+    UBYTE pad;
+    UWORD packets;              /* Packets flushed so far */
+    struct DNSNameTable names;  /* Compression targets in this packet */
+    ULONG maxTTL;               /* Cap on record TTLs, 0 for none */
+    DNSFlushFunc flush;
+    APTR userData;
+};
+
 /* Function prototypes */
+/* dnsBuildMessage writes the header only; questions and records are
+ * appended after it with dnsBuildQuestion and dnsBuildRecord. */
 LONG dnsParseMessage(const UBYTE *data, LONG len, struct DNSMessage *msg);
-LONG dnsParseQuestion(const UBYTE *data, LONG len, struct DNSQuestion *q);
-LONG dnsParseRecord(const UBYTE *data, LONG len, struct DNSRecord *r);
-LONG dnsBuildMessage(UBYTE *buffer, LONG buflen, const struct DNSMessage *msg);
-LONG dnsBuildQuestion(UBYTE *buffer, LONG buflen, const struct DNSQuestion *q);
-LONG dnsBuildRecord(UBYTE *buffer, LONG buflen, const struct DNSRecord *r);
+LONG dnsEntryName(struct DNSMessage *msg, const struct DNSEntry *entry,
+                  char *name, LONG namelen);
+LONG dnsParseQuestion(const UBYTE *data, LONG len, LONG offset, struct DNSQuestion *q);
+LONG dnsParseRecord(const UBYTE *data, LONG len, LONG offset, struct DNSRecord *r);
+LONG dnsRDataInit(struct DNSRDataIter *iter, const UBYTE *data, LONG len,
+                  LONG rdoffset, UWORD rdlength, UWORD type);
+LONG dnsEntryRData(const struct DNSMessage *msg, const struct DNSEntry *entry,
+                   struct DNSRDataIter *iter);
+LONG dnsRDataNext(struct DNSRDataIter *iter, struct DNSRData *rd);
+BOOL dnsNSECHasType(const struct DNSRData *rd, UWORD type);
+BOOL dnsEntryRDataEqual(struct DNSMessage *msg, const struct DNSEntry *entry,
+                        const UBYTE *rdata, UWORD rdlength);
+LONG dnsBuildMessage(UBYTE *buffer, LONG buflen, const struct DNSHeader *header);
+LONG dnsBuildQuestion(UBYTE *buffer, LONG buflen, const struct DNSQuestion *q,
+                      struct DNSNameTable *names);
+LONG dnsBuildRecord(UBYTE *buffer, LONG buflen, const struct DNSRecord *r,
+                    struct DNSNameTable *names);
+LONG dnsCopyRecord(UBYTE *buffer, LONG buflen, const UBYTE *wire, LONG length,
+                   struct DNSNameTable *names);
+LONG dnsBuildNSEC(UBYTE *buffer, LONG buflen, const char *name, UWORD class,
+                  ULONG ttl, const UWORD *types, LONG numTypes);
 LONG dnsNameToLabels(const char *name, UBYTE *buffer, LONG buflen);
+/* Compression: names may be NULL to write full label sequences */
+void dnsInitNameTable(struct DNSNameTable *names, const UBYTE *base);
+LONG dnsWriteName(UBYTE *buffer, LONG buflen, const char *name,
+                  struct DNSNameTable *names);
+LONG dnsWriteLabels(UBYTE *buffer, LONG buflen, const UBYTE *labels,
+                    struct DNSNameTable *names);
 LONG dnsLabelsToName(const UBYTE *labels, LONG len, char *name, LONG namelen);
+void dnsInitNameCache(struct DNSNameCache *cache);
+LONG dnsReadName(const UBYTE *data, LONG len, LONG offset, char *name, LONG namelen,
+                 struct DNSNameCache *cache);
 UBYTE *dnsSkipName(const UBYTE *data, LONG len);
 
+/* Case-insensitive name matching, RFC 6762 section 16 */
+BOOL dnsCaseEqual(const UBYTE *a, const UBYTE *b, LONG len);
+void dnsFoldCase(UBYTE *dst, const UBYTE *src, LONG len);
+BOOL dnsNameEqual(const char *a, const char *b);
+BOOL dnsNameHasSuffix(const char *name, const char *suffix);
+BOOL dnsLabelsHaveSuffix(const UBYTE *labels, const UBYTE *suffix);
+
+/* Packet writer */
+void dnsWriterInit(struct DNSPacketWriter *writer, UBYTE *buffer, LONG budget,
+                   UBYTE flags1, DNSFlushFunc flush, APTR userData);
+LONG dnsWriterAddQuestion(struct DNSPacketWriter *writer, const struct DNSQuestion *q);
+LONG dnsWriterAddRecord(struct DNSPacketWriter *writer, UBYTE section,
+                        const struct DNSRecord *r);
+LONG dnsWriterAddWire(struct DNSPacketWriter *writer, UBYTE section,
+                      const UBYTE *wire, LONG length);
+LONG dnsWriterRoom(const struct DNSPacketWriter *writer);
+LONG dnsWriterFlush(struct DNSPacketWriter *writer);
+
 #endif /* DNS_H */ 
\ No newline at end of file
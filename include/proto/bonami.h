@@ -80,6 +80,8 @@ struct BonAmiBase {
 
 /* Function prototypes */
 LONG BARegisterService(struct BAService *service);
+LONG BARegisterServices(struct BABatch *batch);
+LONG BARegisterServiceNotify(struct BAService *service, BARegisterCallback callback, APTR userData);
 LONG BAUnregisterService(STRPTR name, STRPTR type);
 LONG BADiscoverServices(STRPTR type, struct BAService **services, ULONG *numServices);
 LONG BAStartDiscovery(struct BADiscovery *discovery);
@@ -106,6 +108,8 @@ struct BonAmiIFace {
     LONG (*BAUpdateService)(struct BonAmiIFace *Self, STRPTR name, STRPTR type, STRPTR txt);
     STRPTR (*BACreateTXTRecord)(struct BonAmiIFace *Self, STRPTR key, STRPTR value);
     VOID (*BAFreeTXTRecord)(struct BonAmiIFace *Self, STRPTR record);
+    LONG (*BARegisterServices)(struct BonAmiIFace *Self, struct BABatch *batch);
+    LONG (*BARegisterServiceNotify)(struct BonAmiIFace *Self, struct BAService *service, BARegisterCallback callback, APTR userData);
 };
 #endif
 
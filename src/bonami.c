@@ -4,14 +4,17 @@
 #include <exec/ports.h>
 #include <exec/semaphores.h>
 #include <dos/dos.h>
+#include <devices/timer.h>
 #include <proto/exec.h>
 #include <proto/dos.h>
+#include <proto/timer.h>
 #include <proto/bsdsocket.h>
 #include <proto/roadshow.h>
 #include <proto/utility.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <stddef.h>
 
 #include "/include/bonami.h"
 #include "/include/dns.h"
@@ -35,9 +38,9 @@ static const char version[] = "$VER: Bonami 40.0 (01.01.2024)";
 #define CACHE_TIMEOUT 300
 #define PROBE_WAIT 250     /* 250ms between probes */
 #define PROBE_NUM 3        /* Number of probes */
-#define ANNOUNCE_WAIT 1000 /* 1s between announcements */
+#define PROBE_DEFER 1000   /* Wait after losing a simultaneous probe (RFC 6762 8.2) */
+#define ANNOUNCE_WAIT 1000 /* 1s to the second announcement, doubling after */
 #define ANNOUNCE_NUM 3     /* Number of announcements */
-#define MAX_PACKET_SIZE 4096
 #define MAX_SERVICES 256
 #define MAX_CACHE_ENTRIES 1024
 #define DISCOVERY_TIMEOUT 5
@@ -45,6 +48,23 @@ static const char version[] = "$VER: Bonami 40.0 (01.01.2024)";
 #define MAX_MULTICAST_ADDRESSES 32
 #define INTERFACE_CHECK_INTERVAL 5  /* Check interfaces every 5 seconds */
 #define INTERFACE_SIGNAL 0x80000000 /* Signal bit for interface changes */
+#define NAME_HASH_SIZE 256          /* Name table buckets, power of two */
+#define MAX_NAME_ATOMS 4096         /* Atom IDs, 0 means no name */
+#define RECORD_HASH_SIZE 256        /* Record buckets per interface, power of two */
+#define RESPONSE_DELAY_MIN 20       /* Shared answers wait 20-120ms (RFC 6762 6) */
+#define RESPONSE_DELAY_MAX 120
+#define LEGACY_TTL 10               /* TTL cap for legacy unicast replies (RFC 6762 6.7) */
+#define MAX_NEGATIVES 16            /* NSEC answers per response */
+#define MAX_NSEC_TYPES 8            /* Record types one of our names can have */
+#define WHEEL_BITS 6                /* Timer wheel slots per level, as a power of two */
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4              /* 1ms slots at level 0, 2^24ms (4.6h) span in all */
+#define CACHE_EXPIRY_STEP 3600      /* Longest expiry timer, in seconds, within the wheel span */
+#define QUERY_INTERVAL_MIN 1000     /* Continuous queries back off from 1s (RFC 6762 5.2) */
+#define QUERY_INTERVAL_MAX 3600000  /* to one hour */
+#define PROPOSED_RECORDS 2          /* SRV and TXT sent with each probe (RFC 6762 8.2) */
+#define MAX_PROPOSED 8              /* Records of another host's probe we compare */
+#define MAX_PROBE_BATCH 32          /* Probes sent in one packet */
 
 /* Multicast modes */
 #define MULTICAST_MODE_AUTO 0
@@ -75,6 +95,7 @@ static const char version[] = "$VER: Bonami 40.0 (01.01.2024)";
 #define MSG_MONITOR    7
 #define MSG_CONFIG     8
 #define MSG_ENUMERATE  9
+#define MSG_REGISTER_BATCH 10
 
 /* Memory pool sizes */
 #define POOL_PUDDLE_SIZE   4096
@@ -88,6 +109,8 @@ struct BAMessage {
     union {
         struct {
             struct BAService *service;
+            BARegisterCallback callback;  /* Outcome once probing ends, or NULL */
+            APTR userData;
             LONG result;
         } register_msg;
         struct {
@@ -128,10 +151,60 @@ struct BAMessage {
             struct List *types;
             LONG result;
         } enumerate_msg;
+        struct {
+            struct BABatch *batch;
+            LONG result;
+        } batch_msg;
     } data;
 };
 
 /* Interface state */
+/* Answers collected from every question of one incoming query, and the
+ * records that go with them in the additional section. Names asked for a
+ * type we lack are answered with an NSEC (RFC 6762 6.1), rendered when
+ * the response is sent. Responses go to the mDNS group unless direct is
+ * set. */
+struct Response {
+    struct RecordNode *answers[MAX_ANSWERS];
+    struct RecordNode *additionals[MAX_ADDITIONAL];
+    UWORD negatives[MAX_NEGATIVES];  /* Name atoms with an NSEC answer */
+    UWORD nsecNames[MAX_ADDITIONAL]; /* Name atoms with an additional NSEC */
+    UWORD numAnswers;
+    UWORD numAdditionals;
+    UWORD numNegatives;
+    UWORD numNsecNames;
+    BOOL direct;               /* Unicast to 'to' */
+    BOOL legacy;               /* One-shot querier, see sendResponse */
+    struct sockaddr_in to;     /* Querier address and port */
+    struct DNSMessage *query;  /* Legacy query whose questions are echoed */
+};
+
+/* Deadline in the daemon's timer wheel. The owner embeds it and func
+ * gets data back when getMillis() reaches due. */
+struct Timer {
+    struct MinNode node;       /* In a bonami.timerSlots list */
+    ULONG due;                 /* getMillis() time */
+    BOOL armed;
+    void (*func)(APTR data);
+    APTR data;
+};
+
+/* Where a packet writer sends its packets */
+struct PacketTarget {
+    struct InterfaceState *iface;
+    const struct sockaddr_in *to;  /* NULL for the mDNS group */
+};
+
+/* Where announcements go, and which of their packets failed to send */
+struct AnnounceTarget {
+    struct InterfaceState *iface;
+    ULONG failed;     /* PACKET_BIT of each packet that failed */
+    UWORD packets;    /* Packets handed over so far */
+};
+
+/* Bit of packet n in AnnounceTarget.failed, packets from 31 on share one */
+#define PACKET_BIT(n) (1UL << ((n) < 31 ? (n) : 31))
+
 struct InterfaceState {
     struct in_addr addr;
     BOOL active;
@@ -139,8 +212,12 @@ struct InterfaceState {
     LONG lastCheck;
     struct List services;  /* Services on this interface */
     struct List probes;    /* Services being probed */
-    struct List announces; /* Services being announced */
-    struct List records;   /* DNS records on this interface */
+    struct Response pending;  /* Shared answers waiting for pendingTimer */
+    struct Timer pendingTimer;   /* Sends pending */
+    struct Timer probeTimer;     /* Next due probe */
+    struct DNSPacketWriter goodbyes;  /* TTL 0 records not yet sent */
+    struct Timer goodbyeTimer;        /* Sends goodbyes */
+    UBYTE goodbyeBuffer[DNS_DEFAULT_BUDGET];
     struct List questions;  /* DNS questions on this interface */
     LONG socket;          /* Socket for this interface */
     char name[32];        /* Interface name */
@@ -149,15 +226,90 @@ struct InterfaceState {
     struct in_addr lastAddr; /* Last known IP address */
 };
 
-/* Cache entry */
+/* Interned DNS name, the display spelling follows the canonical form */
+struct NameAtom {
+    struct NameAtom *next;  /* Hash chain */
+    ULONG hash;             /* Hash of the canonical form */
+    ULONG refCount;
+    ULONG size;             /* Allocation size for FreePooled */
+    UWORD id;               /* Compact ID, index into bonami.atoms */
+    UWORD length;
+    char *display;          /* Spelling as first interned, used on the wire */
+    char name[1];           /* Canonical lowercase form */
+};
+
+/* Cache entry, RDATA is kept decoded */
 struct CacheEntry {
     struct Node node;
-    char name[BA_MAX_NAME_LEN];
+    UWORD nameAtom;      /* Interned owner name */
     WORD type;
     WORD class;
-    struct DNSRecord record;
     LONG ttl;
-    LONG timestamp;
+    struct Timer expiry;  /* Drops the entry when its TTL runs out */
+    ULONG ttlLeft;       /* Seconds of TTL not yet on the expiry timer */
+    UWORD targetAtom;    /* PTR and SRV target */
+    UWORD priority;      /* SRV */
+    UWORD weight;        /* SRV */
+    UWORD port;          /* SRV */
+    UBYTE addr[16];      /* A and AAAA */
+    UBYTE *txt;          /* TXT RDATA as received */
+    UWORD txtLength;
+};
+
+/* Record we advertise. There is one copy however many interfaces carry
+ * it; ifaces says which. The node is followed by the record
+ * in final wire form, rendered once when the record is created; record
+ * describes it for matching and record.rdata points into it. */
+struct RecordNode {
+    struct Node node;
+    struct DNSRecord record;  /* record.name is the atom's display text */
+    UWORD nameAtom;           /* Interned owner name */
+    UWORD targetAtom;         /* PTR/SRV target, 0 for other types */
+    ULONG lastMulticast;      /* getMillis() when last sent to the group, 0 if never */
+    UWORD wireLength;         /* Bytes of wire form */
+    UBYTE *wire;              /* Owner labels, fixed fields and RDATA */
+    ULONG size;               /* Allocation size for FreePooled */
+    struct RecordNode *hashNext;     /* Chain in bonami.recordHash */
+    struct MinNode ownerNode;        /* In owner->records */
+    struct BAServiceNode *owner;     /* Service the record belongs to, or NULL */
+    ULONG ifaces;                    /* IFACE_BIT of each interface carrying it */
+    BOOL unique;                     /* Only we answer for it, PTRs are shared */
+    struct MinNode announceNode;     /* In bonami.announcing while announceIfaces is set */
+    ULONG announceIfaces;            /* Interfaces it is still announced on */
+    ULONG announceNext[MAX_INTERFACES];   /* getMillis() time of the next one, per interface */
+    UBYTE announceCount[MAX_INTERFACES];  /* Announcements sent so far, per interface */
+    UWORD announcePacket;            /* Packet of the current round it was written to */
+};
+
+/* Bucket of a name atom in bonami.recordHash */
+#define RECORD_HASH(atom) ((atom) & (RECORD_HASH_SIZE - 1))
+
+/* Bit of an interface in RecordNode.ifaces and BAServiceNode.ifaces */
+#define IFACE_BIT(iface) (1UL << ((iface) - bonami.interfaces))
+
+/* Record that an ownerNode is embedded in */
+#define OWNER_RECORD(n) \
+    ((struct RecordNode *)((UBYTE *)(n) - offsetof(struct RecordNode, ownerNode)))
+
+/* Record that an announceNode is embedded in */
+#define ANNOUNCE_RECORD(n) \
+    ((struct RecordNode *)((UBYTE *)(n) - offsetof(struct RecordNode, announceNode)))
+
+/* Outstanding query */
+struct DNSQuery {
+    struct Node node;
+    char name[BA_MAX_NAME_LEN];
+    UWORD type;
+    UWORD class;
+};
+
+/* Probe in flight, its query is sent PROBE_NUM times */
+struct Probe {
+    struct Node node;
+    struct DNSQuery *query;
+    struct BAServiceNode *service;  /* Announced when probing ends, or NULL */
+    LONG count;
+    ULONG nextTime;                 /* getMillis() time of the next send */
 };
 
 /* Service node */
@@ -170,6 +322,24 @@ struct BAServiceNode {
     LONG announceCount;
     LONG lastProbe;
     LONG lastAnnounce;
+    UWORD instanceAtom;  /* "name.type" */
+    UWORD typeAtom;      /* Owner of the PTR record */
+    struct MinList records;  /* Its records, shared by all interfaces */
+    ULONG ifaces;            /* Interfaces it is advertised on */
+    UWORD hostAtom;          /* SRV target the records were built with */
+    BOOL dirty;              /* Service data changed, records must be rebuilt */
+    BARegisterCallback callback;  /* Told the outcome of probing, or NULL */
+    APTR userData;
+    struct RecordNode *proposed[PROPOSED_RECORDS];  /* Sent while probing, or NULL */
+};
+
+/* A record from a probe's authority section, in the uncompressed form
+ * that simultaneous probes are compared in */
+struct ProposedRecord {
+    UWORD class;
+    UWORD type;
+    UWORD rdlength;
+    const UBYTE *rdata;
 };
 
 /* Discovery node */
@@ -178,6 +348,8 @@ struct BADiscoveryNode {
     struct BADiscovery discovery;
     struct Task *task;
     BOOL running;
+    struct Timer queryTimer;  /* Next query for the type */
+    ULONG queryInterval;      /* Doubles after every query */
 };
 
 /* Monitor node */
@@ -204,6 +376,21 @@ static struct {
     struct List monitors;
     struct List updateCallbacks;
     struct List cache;
+    struct NameAtom *nameHash[NAME_HASH_SIZE];  /* Interned names by hash */
+    struct NameAtom *atoms[MAX_NAME_ATOMS];     /* Interned names by ID */
+    UWORD lastAtom;                             /* Last ID handed out */
+    struct List records;                        /* Records we advertise */
+    struct RecordNode *recordHash[RECORD_HASH_SIZE];  /* Records by owner name */
+    ULONG randomSeed;                           /* State of randomRange */
+    struct MinList timerSlots[WHEEL_LEVELS][WHEEL_SIZE];  /* Timer wheel */
+    ULONG timerNow;                             /* Time the wheel has run up to */
+    struct timerequest clockReq;                /* Holds timer.device open for the E-clock */
+    ULONG clockLast;                            /* E-clock low word at the last getMillis() */
+    ULONG clockRest;                            /* E-clock ticks not yet counted as a ms */
+    ULONG clockMillis;                          /* Value getMillis() last returned */
+    struct Timer checkTimer;                    /* Interface recheck */
+    struct MinList announcing;                  /* Records being announced */
+    struct Timer announceTimer;                 /* Next due announcement */
     struct InterfaceState interfaces[MAX_INTERFACES];
     LONG num_interfaces;
     char hostname[256];
@@ -221,6 +408,7 @@ static struct {
     #ifdef __amigaos4__
     struct RoadshowIFace *IRoadshow;
     struct UtilityIFace *IUtility;
+    struct TimerIFace *ITimer;
     #endif
     struct Library *BonAmiBase;
     struct Task *task;
@@ -232,11 +420,16 @@ static struct {
     #endif
 } bonami;
 
+#ifndef __amigaos4__
+struct Device *TimerBase;  /* For ReadEClock */
+#endif
+
 /* Function prototypes */
 static LONG initDaemon(void);
 static void cleanupDaemon(void);
-static void networkMonitorTask(void);
-static void discoveryTask(void);
+static void recheckInterfaces(APTR data);
+static void sendDiscoveryQuery(APTR data);
+static void expireCacheEntry(APTR data);
 static void processMessage(struct BAMessage *msg);
 static LONG createMulticastSocket(void);
 static LONG checkNetworkStatus(void);
@@ -253,27 +446,69 @@ static LONG initInterfaces(void);
 static void cleanupInterfaces(void);
 static LONG checkInterface(struct InterfaceState *iface);
 static void updateInterfaceServices(struct InterfaceState *iface);
-static void addCacheEntry(const char *name, WORD type, WORD class, 
-                         const struct DNSRecord *record, LONG ttl);
+static struct CacheEntry *addCacheEntry(const char *name, WORD type, WORD class, LONG ttl);
+static LONG storeCacheData(struct CacheEntry *entry, const struct DNSRData *rd,
+                           const char *target, const UBYTE *rdata, UWORD rdlength);
+static void freeCacheEntry(struct CacheEntry *entry);
+static void setCacheExpiry(struct CacheEntry *entry);
+static void stepCacheExpiry(struct CacheEntry *entry);
 static void removeCacheEntry(const char *name, WORD type, WORD class);
-static struct CacheEntry *findCacheEntry(const char *name, WORD type, WORD class);
+static struct CacheEntry *findCacheEntry(UWORD nameAtom, WORD type, WORD class,
+                                         UWORD targetAtom);
 static void cleanupCache(void);
 static LONG resolveHostname(void);
-static LONG checkServiceConflict(const char *name, const char *type);
-static void startServiceProbing(struct InterfaceState *iface, struct BAService *service);
-static void startServiceAnnouncement(struct InterfaceState *iface, struct BAService *service);
-static void processServiceStates(struct InterfaceState *iface);
+static void startServiceProbing(struct InterfaceState *iface, struct BAServiceNode *service,
+                                ULONG start);
+static void cancelProbes(struct BAServiceNode *service);
+static void freeProposed(struct BAServiceNode *service);
+static LONG probeSize(const struct Probe *probe);
+static void writeProbes(struct DNSPacketWriter *writer, struct Probe **probes, LONG count);
+static LONG compareProposed(const struct ProposedRecord *a, const struct ProposedRecord *b);
+static void sortProposed(struct ProposedRecord *records, LONG count);
+static LONG readProposed(struct DNSMessage *msg, const char *name,
+                         struct ProposedRecord *records, UBYTE *buffer);
+static void checkProbeTiebreak(struct InterfaceState *iface, struct DNSMessage *msg,
+                               const char *name);
+static void freeProbe(struct Probe *probe);
+static LONG validateService(const struct BAService *info);
+static LONG addService(const struct BAService *info, ULONG start,
+                       BARegisterCallback callback, APTR userData);
+static void checkProbeConflict(struct InterfaceState *iface, const char *name);
+static void removeService(struct BAServiceNode *service);
+static void startServiceAnnouncement(struct InterfaceState *iface, struct BAServiceNode *service);
+static void addServiceRecords(struct InterfaceState *iface, struct BAServiceNode *service);
+static void buildServiceRecords(struct BAServiceNode *service);
+static void replaceRecord(struct BAServiceNode *service, struct RecordNode *record);
 static void handleSignals(void);
 static void processUpdateCallbacks(struct BAService *service);
-static struct DNSRecord *createPTRRecord(const char *type, const char *name);
-static struct DNSRecord *createSRVRecord(const char *name, UWORD port, const char *host);
-static struct DNSRecord *createTXTRecord(const char *name, const struct BATXTRecord *txt);
-static struct DNSQuestion *createProbeQuestion(const char *name, const char *type);
-static void addRecord(struct InterfaceState *iface, struct DNSRecord *record);
-static void addQuestion(struct InterfaceState *iface, struct DNSQuestion *question);
-static void removeRecord(struct InterfaceState *iface, const char *name, UWORD type);
-static void scheduleAnnouncement(struct InterfaceState *iface, struct DNSRecord *record);
-static void scheduleQuery(struct InterfaceState *iface, struct DNSQuestion *question);
+static void buildInstanceName(char *buffer, const struct BAService *service);
+static LONG foldName(const char *name, char *folded, ULONG *hash);
+static struct NameAtom *lookupAtom(const char *folded, LONG length, ULONG hash);
+static UWORD internName(const char *name);
+static UWORD findName(const char *name);
+static void releaseName(UWORD id);
+static const char *atomName(UWORD id);
+static struct RecordNode *allocRecord(const char *name, UWORD type, UWORD rdlength);
+static void freeRecord(struct RecordNode *record);
+static struct RecordNode *createPTRRecord(const char *type, const char *instance);
+static struct RecordNode *createSRVRecord(const char *instance, UWORD port, const char *host);
+static struct RecordNode *createTXTRecord(const char *instance, const struct BATXTRecord *txt);
+static struct RecordNode *createARecord(const char *host, struct in_addr addr);
+static void addHostRecord(struct InterfaceState *iface);
+static struct DNSQuery *createProbeQuestion(const char *instance);
+static void addRecord(struct RecordNode *record, struct BAServiceNode *owner, ULONG ifaces);
+static void unlinkRecord(struct RecordNode *record);
+static void addQuestion(struct InterfaceState *iface, struct DNSQuery *query,
+                        struct BAServiceNode *service, ULONG start);
+static void dropRecord(struct RecordNode *record);
+static void withdrawRecord(struct RecordNode *record, ULONG ifaces);
+static void queueGoodbye(struct InterfaceState *iface, struct RecordNode *record);
+static void flushGoodbyes(APTR data);
+static void scheduleAnnouncement(struct InterfaceState *iface, struct RecordNode *record);
+static void scheduleQuery(struct InterfaceState *iface, struct DNSQuery *query,
+                          struct BAServiceNode *service, ULONG start);
+static void processProbes(APTR data);
+static void processAnnouncements(APTR data);
 static struct DNSQuery *getNextQuery(struct InterfaceState *iface);
 static void requeueQuery(struct InterfaceState *iface, struct DNSQuery *query);
 static LONG sendQuery(struct InterfaceState *iface, struct DNSQuery *query);
@@ -283,9 +518,46 @@ static void FreePooled(APTR memory, ULONG size);
 static LONG initMulticast(struct InterfaceState *iface);
 static void cleanupMulticast(struct InterfaceState *iface);
 static void orphanTask(void);
-static void processDNSMessage(struct InterfaceState *iface, struct DNSMessage *msg);
-static void processQuestion(struct InterfaceState *iface, struct DNSQuestion *question);
-static void processRecord(struct InterfaceState *iface, struct DNSRecord *record);
+static LONG sendDNSMessage(struct InterfaceState *iface, const UBYTE *data, LONG len,
+                           const struct sockaddr_in *to);
+static LONG sendPacket(const UBYTE *data, LONG len, APTR userData);
+static LONG sendPacketTo(const UBYTE *data, LONG len, APTR userData);
+static LONG sendAnnouncement(const UBYTE *data, LONG len, APTR userData);
+static LONG receiveDNSMessage(struct InterfaceState *iface, UBYTE *buffer, LONG buflen,
+                              struct DNSMessage *msg, struct sockaddr_in *from);
+static void processDNSMessages(struct InterfaceState *iface);
+static void processDNSMessage(struct InterfaceState *iface, struct DNSMessage *msg,
+                              const struct sockaddr_in *from);
+static void processQuestion(struct InterfaceState *iface, struct DNSQuestion *question,
+                            struct Response *response, struct Response *direct);
+static void initResponse(struct Response *response);
+static void addAnswer(struct InterfaceState *iface, struct Response *response,
+                      struct RecordNode *record);
+static void sendResponse(struct InterfaceState *iface, struct Response *response);
+static void suppressAnswers(struct DNSMessage *msg, struct Response *response, BOOL known);
+static void queueResponse(struct InterfaceState *iface, struct Response *response);
+static void processPendingResponse(APTR data);
+static void forgetAnswer(struct Response *response, struct RecordNode *record);
+static ULONG getMillis(void);
+static void closeClock(void);
+static ULONG randomRange(ULONG low, ULONG high);
+static void initTimer(struct Timer *timer, void (*func)(APTR data), APTR data);
+static void setTimer(struct Timer *timer, ULONG due);
+static void setTimerBy(struct Timer *timer, ULONG due);
+static void clearTimer(struct Timer *timer);
+static void insertTimer(struct Timer *timer);
+static void runTimers(ULONG now);
+static BOOL nextTimer(ULONG *due);
+static void waitForWork(void);
+static void addAdditionals(struct InterfaceState *iface, struct Response *response);
+static void addName(UWORD *names, UWORD *count, UWORD max, UWORD atom);
+static LONG ownedTypes(struct InterfaceState *iface, UWORD atom, UWORD *types, ULONG *ttl);
+static void writeNSEC(struct InterfaceState *iface, struct DNSPacketWriter *writer,
+                      UBYTE section, UWORD atom);
+static void addRelated(struct InterfaceState *iface, struct Response *response,
+                       UWORD atom, UWORD type);
+static void processRecord(struct InterfaceState *iface, struct DNSMessage *msg,
+                          const struct DNSEntry *rr, const char *name);
 static BOOL isInterfaceOnline(struct InterfaceState *iface);
 static void checkInterfaces(void);
 static void mainTask(void);
@@ -316,43 +588,32 @@ int main(int argc, char **argv) {
         return RETURN_ERROR;
     }
     
+    /* Interfaces are checked again from the timer wheel */
+    recheckInterfaces(NULL);
+    
     /* Main loop */
     while (bonami.running) {
         /* Check for signals */
         handleSignals();
         
-        /* Check interfaces */
-        checkInterfaces();
-        
         /* Process messages */
-        msg = WaitPort(bonami.port);
-        if (msg) {
-            msg = GetMsg(bonami.port);
-            if (msg) {
-                processMessage((struct BAMessage *)msg);
-            }
+        while ((msg = GetMsg(bonami.port))) {
+            processMessage((struct BAMessage *)msg);
         }
         
-        /* Process each active interface */
+        /* Process DNS messages on each active interface */
         for (i = 0; i < bonami.num_interfaces; i++) {
             iface = &bonami.interfaces[i];
-            
-            if (!iface->active || !iface->online) {
-                continue;
+            if (iface->active && iface->online) {
+                processDNSMessages(iface);
             }
-            
-            /* Process probes */
-            processProbes(iface);
-            
-            /* Process announcements */
-            processAnnouncements(iface);
-            
-            /* Process DNS messages */
-            processDNSMessages(iface);
         }
         
-        /* Small delay to prevent CPU hogging */
-        Delay(1);
+        /* Probes, announcements, delayed responses, queries, cache expiry */
+        runTimers(getMillis());
+        
+        /* Sleep until there is something to do */
+        waitForWork();
     }
     
     /* Cleanup */
@@ -363,7 +624,8 @@ int main(int argc, char **argv) {
 
 /* Handle signals */
 static void handleSignals(void) {
-    ULONG signals = SetSignal(0, 0);
+    /* Clear the break bits as we read them, or the main loop never sleeps */
+    ULONG signals = SetSignal(0, SIGBREAKF_CTRL_C | SIGBREAKF_CTRL_D | SIGBREAKF_CTRL_E);
     if (signals & SIGBREAKF_CTRL_C) {
         /* Graceful shutdown */
         logMessage(LOG_INFO, "Received shutdown signal\n");
@@ -385,6 +647,7 @@ static LONG initDaemon(void)
 {
     struct RDArgs *args;
     LONG result;
+    LONG i;
     
     /* Parse command line */
     args = ReadArgs(template, NULL, NULL);
@@ -400,12 +663,40 @@ static LONG initDaemon(void)
         return BA_NOMEM;
     }
     
+    /* Open timer.device for the E-clock, which unlike the system time
+     * never jumps when the clock is set */
+    if (OpenDevice(TIMERNAME, UNIT_MICROHZ, (struct IORequest *)&bonami.clockReq, 0) != 0) {
+        DeletePool(bonami.memPool);
+        FreeArgs(args);
+        return BA_ERROR;
+    }
+    #ifdef __amigaos4__
+    bonami.ITimer = (struct TimerIFace *)GetInterface((struct Library *)bonami.clockReq.tr_node.io_Device,
+                                                      "main", 1, NULL);
+    if (!bonami.ITimer) {
+        CloseDevice((struct IORequest *)&bonami.clockReq);
+        DeletePool(bonami.memPool);
+        FreeArgs(args);
+        return BA_ERROR;
+    }
+    #else
+    TimerBase = bonami.clockReq.tr_node.io_Device;
+    #endif
+    
     /* Initialize lists */
     NewList(&bonami.services);
     NewList(&bonami.discoveries);
     NewList(&bonami.monitors);
     NewList(&bonami.updateCallbacks);
     NewList(&bonami.cache);
+    NewList(&bonami.records);
+    for (i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++) {
+        NewList((struct List *)&bonami.timerSlots[i / WHEEL_SIZE][i % WHEEL_SIZE]);
+    }
+    bonami.timerNow = getMillis();
+    initTimer(&bonami.checkTimer, recheckInterfaces, NULL);
+    NewList((struct List *)&bonami.announcing);
+    initTimer(&bonami.announceTimer, processAnnouncements, NULL);
     
     /* Initialize state */
     bonami.num_interfaces = 0;
@@ -417,6 +708,7 @@ static LONG initDaemon(void)
     /* Create message port */
     bonami.port = CreateMsgPort();
     if (!bonami.port) {
+        closeClock();
         DeletePool(bonami.memPool);
         FreeArgs(args);
         return BA_ERROR;
@@ -432,6 +724,7 @@ static LONG initDaemon(void)
         bonami.log_file = Open((char *)args->RDA_LOGFILE, MODE_NEWFILE);
         if (!bonami.log_file) {
             DeleteMsgPort(bonami.port);
+            closeClock();
             DeletePool(bonami.memPool);
             FreeArgs(args);
             return BA_ERROR;
@@ -446,6 +739,7 @@ static LONG initDaemon(void)
             Close(bonami.log_file);
         }
         DeleteMsgPort(bonami.port);
+        closeClock();
         DeletePool(bonami.memPool);
         FreeArgs(args);
         return BA_ERROR;
@@ -458,6 +752,7 @@ static LONG initDaemon(void)
             Close(bonami.log_file);
         }
         DeleteMsgPort(bonami.port);
+        closeClock();
         DeletePool(bonami.memPool);
         FreeArgs(args);
         return BA_ERROR;
@@ -472,6 +767,7 @@ static LONG initDaemon(void)
             Close(bonami.log_file);
         }
         DeleteMsgPort(bonami.port);
+        closeClock();
         DeletePool(bonami.memPool);
         FreeArgs(args);
         return BA_ERROR;
@@ -486,6 +782,7 @@ static LONG initDaemon(void)
             Close(bonami.log_file);
         }
         DeleteMsgPort(bonami.port);
+        closeClock();
         DeletePool(bonami.memPool);
         FreeArgs(args);
         return BA_ERROR;
@@ -505,6 +802,7 @@ static LONG initDaemon(void)
             Close(bonami.log_file);
         }
         DeleteMsgPort(bonami.port);
+        closeClock();
         DeletePool(bonami.memPool);
         FreeArgs(args);
         return result;
@@ -523,6 +821,7 @@ static LONG initDaemon(void)
             Close(bonami.log_file);
         }
         DeleteMsgPort(bonami.port);
+        closeClock();
         DeletePool(bonami.memPool);
         FreeArgs(args);
         return result;
@@ -688,6 +987,8 @@ static void cleanupDaemon(void)
         bonami.port = NULL;
     }
     
+    closeClock();
+    
     /* Delete memory pool */
     if (bonami.memPool) {
         DeletePool(bonami.memPool);
@@ -742,7 +1043,7 @@ static LONG validateServiceType(const char *type)
     p += 3;
     
     /* Check for .local suffix */
-    if (strcmp(p, ".local") != 0) {
+    if (*p != '.' || !dnsNameEqual(p + 1, "local")) {
         return BA_BADTYPE;
     }
     hasLocal = TRUE;
@@ -757,83 +1058,78 @@ static void processMessage(struct BAMessage *msg)
     struct BADiscoveryNode *discovery;
     struct BAMonitorNode *monitor;
     struct BAUpdateCallbackNode *callback;
+    struct BABatch *batch;
+    ULONG start;
+    ULONG i, j;
     LONG result = BA_OK;
     
     /* Process message based on type */
     switch (msg->type) {
         case MSG_REGISTER:
-            /* Validate service name */
-            result = validateServiceName(msg->data.register_msg.service->name);
+            /* Validate service */
+            result = validateService(msg->data.register_msg.service);
             if (result != BA_OK) {
                 msg->data.register_msg.result = result;
                 ReplyMsg((struct Message *)msg);
                 return;
             }
             
-            /* Validate service type */
-            result = validateServiceType(msg->data.register_msg.service->type);
-            if (result != BA_OK) {
-                msg->data.register_msg.result = result;
-                ReplyMsg((struct Message *)msg);
-                return;
-            }
+            /* Accepted, the outcome of probing reaches the client through
+             * its callback. First probe after a random 0-250ms delay
+             * (RFC 6762 8.1). */
+            msg->data.register_msg.result =
+                addService(msg->data.register_msg.service,
+                           getMillis() + randomRange(0, PROBE_WAIT),
+                           msg->data.register_msg.callback,
+                           msg->data.register_msg.userData);
+            break;
             
-            /* Validate port */
-            result = validatePort(msg->data.register_msg.service->port);
-            if (result != BA_OK) {
-                msg->data.register_msg.result = result;
+        case MSG_REGISTER_BATCH:
+            batch = msg->data.batch_msg.batch;
+            if (!batch->services || batch->numServices == 0 ||
+                batch->numServices > MAX_SERVICES) {
+                msg->data.batch_msg.result = BA_BADPARAM;
                 ReplyMsg((struct Message *)msg);
                 return;
             }
             
-            /* Validate TXT records */
-            result = validateTXTRecord(msg->data.register_msg.service->txt);
+            /* Validate the whole batch first, including duplicates within it */
+            for (i = 0; i < batch->numServices && result == BA_OK; i++) {
+                result = validateService(&batch->services[i]);
+                for (j = 0; j < i && result == BA_OK; j++) {
+                    if (dnsNameEqual(batch->services[i].name, batch->services[j].name) &&
+                        dnsNameEqual(batch->services[i].type, batch->services[j].type)) {
+                        result = BA_DUPLICATE;
+                    }
+                }
+            }
             if (result != BA_OK) {
-                msg->data.register_msg.result = result;
+                logMessage(LOG_WARN, "Batch rejected at service %ld: %s",
+                           (LONG)(i - 1), batch->services[i - 1].name);
+                msg->data.batch_msg.result = result;
                 ReplyMsg((struct Message *)msg);
                 return;
             }
             
-            /* Check for duplicate service */
-            service = findService(msg->data.register_msg.service->name,
-                                msg->data.register_msg.service->type);
-            if (service) {
-                msg->data.register_msg.result = BA_DUPLICATE;
-                ReplyMsg((struct Message *)msg);
-                return;
+            /* One start time for all, so every probe round and the
+             * announcements that follow share packets */
+            start = getMillis() + randomRange(0, PROBE_WAIT);
+            for (i = 0; i < batch->numServices; i++) {
+                result = addService(&batch->services[i], start,
+                                    batch->callback, batch->userData);
+                if (result != BA_OK) {
+                    break;
+                }
             }
             
-            /* Check for conflicts */
-            result = checkServiceConflict(msg->data.register_msg.service->name,
-                                        msg->data.register_msg.service->type);
+            /* All or nothing, the services added so far are at the tail */
             if (result != BA_OK) {
-                msg->data.register_msg.result = result;
-                ReplyMsg((struct Message *)msg);
-                return;
-            }
-            
-            /* Create service node */
-            service = AllocPooled(sizeof(struct BAServiceNode));
-            if (!service) {
-                msg->data.register_msg.result = BA_NOMEM;
-                ReplyMsg((struct Message *)msg);
-                return;
+                while (i-- > 0) {
+                    removeService((struct BAServiceNode *)bonami.services.lh_TailPred);
+                }
             }
             
-            /* Initialize service */
-            memcpy(&service->service, msg->data.register_msg.service,
-                   sizeof(struct BAService));
-            service->state = 0;  /* Start probing */
-            service->probeCount = 0;
-            service->announceCount = 0;
-            
-            /* Add to service list */
-            AddTail(&bonami.services, (struct Node *)service);
-            
-            /* Start probing */
-            startServiceProbing(&bonami.interfaces[0], &service->service);
-            
-            msg->data.register_msg.result = BA_OK;
+            msg->data.batch_msg.result = result;
             break;
             
         case MSG_UNREGISTER:
@@ -846,12 +1142,7 @@ static void processMessage(struct BAMessage *msg)
                 return;
             }
             
-            /* Remove service records */
-            removeServiceRecords(service);
-            
-            /* Remove from list */
-            Remove((struct Node *)service);
-            FreePooled(service, sizeof(struct BAServiceNode));
+            removeService(service);
             
             msg->data.unregister_msg.result = BA_OK;
             break;
@@ -877,23 +1168,17 @@ static void processMessage(struct BAMessage *msg)
             strncpy(discovery->discovery.type, msg->data.discover_msg.type,
                     sizeof(discovery->discovery.type) - 1);
             discovery->discovery.services = msg->data.discover_msg.services;
+            discovery->task = NULL;
             discovery->running = TRUE;
             
             /* Add to discovery list */
             AddTail(&bonami.discoveries, (struct Node *)discovery);
             
-            /* Start discovery task */
-            discovery->task = CreateTask("BonAmi Discovery",
-                                       -1,
-                                       discoveryTask,
-                                       8192);
-            if (!discovery->task) {
-                Remove((struct Node *)discovery);
-                FreePooled(discovery, sizeof(struct BADiscoveryNode));
-                msg->data.discover_msg.result = BA_NOMEM;
-                ReplyMsg((struct Message *)msg);
-                return;
-            }
+            /* First query after 20-120ms, then backing off (RFC 6762 5.2) */
+            discovery->queryInterval = QUERY_INTERVAL_MIN;
+            initTimer(&discovery->queryTimer, sendDiscoveryQuery, discovery);
+            setTimer(&discovery->queryTimer,
+                     getMillis() + randomRange(RESPONSE_DELAY_MIN, RESPONSE_DELAY_MAX));
             
             msg->data.discover_msg.result = BA_OK;
             break;
@@ -909,9 +1194,7 @@ static void processMessage(struct BAMessage *msg)
             
             /* Stop discovery */
             discovery->running = FALSE;
-            
-            /* Wait for task to finish */
-            Delay(50);  /* Wait 1 second */
+            clearTimer(&discovery->queryTimer);
             
             /* Remove from list */
             Remove((struct Node *)discovery);
@@ -991,6 +1274,7 @@ static void processMessage(struct BAMessage *msg)
             }
             
             /* Update service records */
+            service->dirty = TRUE;
             updateServiceRecords(service);
             
             msg->data.update_msg.result = BA_OK;
@@ -1027,16 +1311,121 @@ static void processMessage(struct BAMessage *msg)
     ReplyMsg((struct Message *)msg);
 }
 
+/* Check a service before registering it */
+static LONG validateService(const struct BAService *info)
+{
+    LONG result;
+    
+    result = validateServiceName(info->name);
+    if (result != BA_OK) {
+        return result;
+    }
+    
+    result = validateServiceType(info->type);
+    if (result != BA_OK) {
+        return result;
+    }
+    
+    result = validatePort(info->port);
+    if (result != BA_OK) {
+        return result;
+    }
+    
+    result = validateTXTRecord(info->txt);
+    if (result != BA_OK) {
+        return result;
+    }
+    
+    if (findService(info->name, info->type)) {
+        return BA_DUPLICATE;
+    }
+    
+    return BA_OK;
+}
+
+/* Add a validated service and start probing it at start, a getMillis()
+ * time. Services given the same start share their probe packets.
+ * callback, if set, hears whether the name turned out to be free. */
+static LONG addService(const struct BAService *info, ULONG start,
+                       BARegisterCallback callback, APTR userData)
+{
+    struct BAServiceNode *service;
+    char instance[BA_MAX_NAME_LEN];
+    LONG i;
+    
+    /* Create service node */
+    service = AllocPooled(sizeof(struct BAServiceNode));
+    if (!service) {
+        return BA_NOMEM;
+    }
+    
+    /* Initialize service */
+    memcpy(&service->service, info, sizeof(struct BAService));
+    buildInstanceName(instance, &service->service);
+    service->instanceAtom = internName(instance);
+    service->typeAtom = internName(service->service.type);
+    if (!service->instanceAtom || !service->typeAtom) {
+        releaseName(service->instanceAtom);
+        releaseName(service->typeAtom);
+        FreePooled(service, sizeof(struct BAServiceNode));
+        return BA_NOMEM;
+    }
+    NewList((struct List *)&service->records);
+    service->ifaces = 0;
+    service->hostAtom = 0;
+    service->dirty = FALSE;
+    service->callback = callback;
+    service->userData = userData;
+    for (i = 0; i < PROPOSED_RECORDS; i++) {
+        service->proposed[i] = NULL;  /* Built when probing starts */
+    }
+    service->state = 0;  /* Start probing */
+    service->probeCount = 0;
+    service->announceCount = 0;
+    
+    /* Add to service list */
+    AddTail(&bonami.services, (struct Node *)service);
+    
+    /* Start probing */
+    startServiceProbing(&bonami.interfaces[0], service, start);
+    
+    return BA_OK;
+}
+
+/* Withdraw a service and free it */
+static void removeService(struct BAServiceNode *service)
+{
+    /* Stop probing, remove service records */
+    cancelProbes(service);
+    freeProposed(service);
+    removeServiceRecords(service);
+    
+    /* Remove from list */
+    Remove((struct Node *)service);
+    releaseName(service->instanceAtom);
+    releaseName(service->typeAtom);
+    releaseName(service->hostAtom);
+    FreePooled(service, sizeof(struct BAServiceNode));
+}
+
 /* Find a service by name and type */
 static struct BAServiceNode *findService(const char *name, const char *type)
 {
     struct BAServiceNode *node;
+    char instance[BA_MAX_NAME_LEN];
+    UWORD atom;
+    
+    /* A name nobody interned cannot belong to a registered service */
+    snprintf(instance, sizeof(instance), "%s.%s", name, type);
+    atom = findName(instance);
+    if (!atom) {
+        return NULL;
+    }
     
     for (node = (struct BAServiceNode *)bonami.services.lh_Head;
          node->node.ln_Succ;
          node = (struct BAServiceNode *)node->node.ln_Succ) {
-        if (strcmp(node->service.name, name) == 0 &&
-            strcmp(node->service.type, type) == 0) {
+        if (node->instanceAtom == atom) {
             return node;
         }
     }
@@ -1052,7 +1441,7 @@ static struct BADiscoveryNode *findDiscovery(const char *type)
     for (node = (struct BADiscoveryNode *)bonami.services.lh_Head;
          node->node.ln_Succ;
          node = (struct BADiscoveryNode *)node->node.ln_Succ) {
-        if (strcmp(node->discovery.type, type) == 0) {
+        if (dnsNameEqual(node->discovery.type, type)) {
             return node;
         }
     }
@@ -1063,317 +1452,951 @@ static struct BADiscoveryNode *findDiscovery(const char *type)
 /* Remove all records for a service */
 static void removeServiceRecords(struct BAServiceNode *service)
 {
-    struct InterfaceState *iface;
-    LONG i;
+    struct RecordNode *record;
     
-    /* Remove from all interfaces */
-    for (i = 0; i < bonami.num_interfaces; i++) {
-        iface = &bonami.interfaces[i];
-        if (iface->active) {
-            /* Remove PTR record */
-            removeRecord(iface, service->service.type, DNS_TYPE_PTR);
-            
-            /* Remove SRV record */
-            removeRecord(iface, service->service.name, DNS_TYPE_SRV);
-            
-            /* Remove TXT record */
-            removeRecord(iface, service->service.name, DNS_TYPE_TXT);
-        }
+    /* The owner index holds the one copy of each */
+    while (service->records.mlh_Head->mln_Succ) {
+        record = OWNER_RECORD(service->records.mlh_Head);
+        dropRecord(record);
     }
 }
 
 /* Start probing for a service */
-static void startServiceProbing(struct InterfaceState *iface, struct BAService *service)
+static void startServiceProbing(struct InterfaceState *iface, struct BAServiceNode *service,
+                                ULONG start)
 {
-    struct DNSRecord *record;
-    struct DNSQuestion *question;
-    LONG i;
+    struct BAService *info = &service->service;
+    struct DNSQuery *query;
+    char instance[BA_MAX_NAME_LEN];
     
-    /* Create PTR record */
-    record = createPTRRecord(service->type, service->name);
-    if (!record) {
-        return;
-    }
+    buildInstanceName(instance, info);
     
-    /* Add to interface */
-    addRecord(iface, record);
+    /* The records we want go in the probe's authority section so that
+     * simultaneous probes can be told apart (RFC 6762 8.2). They are only
+     * sent with the probes; the PTR, SRV and TXT records are added when
+     * probing ends. */
+    if (!service->proposed[0]) {
+        service->proposed[0] = createSRVRecord(instance, info->port,
+                                               info->hostname[0] ? info->hostname
+                                                                 : bonami.hostname);
+        service->proposed[1] = createTXTRecord(instance, info->txt);
+    }
     
-    /* Create SRV record */
-    record = createSRVRecord(service->name, service->port, service->host);
-    if (!record) {
+    /* Create probe question, it is repeated PROBE_NUM times */
+    query = createProbeQuestion(instance);
+    if (!query) {
         return;
     }
     
     /* Add to interface */
-    addRecord(iface, record);
+    addQuestion(iface, query, service, start);
+}
+
+/* Give up a service whose name another host answered for while we
+ * were probing it */
+static void checkProbeConflict(struct InterfaceState *iface, const char *name)
+{
+    struct BAServiceNode *service;
+    struct Probe *probe;
+    UWORD atom;
     
-    /* Create TXT record */
-    record = createTXTRecord(service->name, service->txt);
-    if (!record) {
+    atom = findName(name);
+    if (!atom) {
         return;
     }
     
-    /* Add to interface */
-    addRecord(iface, record);
-    
-    /* Create probe questions */
-    for (i = 0; i < 3; i++) {
-        question = createProbeQuestion(service->name, service->type);
-        if (!question) {
-            continue;
+    for (probe = (struct Probe *)iface->probes.lh_Head;
+         probe->node.ln_Succ;
+         probe = (struct Probe *)probe->node.ln_Succ) {
+        service = probe->service;
+        if (service && service->instanceAtom == atom) {
+            logMessage(LOG_WARN, "Name conflict for %s", name);
+            if (service->callback) {
+                service->callback(&service->service, BA_CONFLICT, service->userData);
+            }
+            removeService(service);
+            return;
         }
-        
-        /* Add to interface */
-        addQuestion(iface, question);
     }
 }
 
-/* Create a PTR record */
-static struct DNSRecord *createPTRRecord(const char *type, const char *name)
+/* Order two proposed records by class, type, then RDATA bytes */
+static LONG compareProposed(const struct ProposedRecord *a, const struct ProposedRecord *b)
 {
-    struct DNSRecord *record = NULL;
-    char *ptrName = NULL;
-    char *nameCopy = NULL;
+    LONG length;
+    LONG result;
     
-    /* Allocate record */
-    record = AllocPooled(sizeof(struct DNSRecord));
-    if (!record) {
-        return NULL;
+    if (a->class != b->class) {
+        return a->class < b->class ? -1 : 1;
     }
-    
-    /* Create PTR name */
-    ptrName = AllocPooled(strlen(type) + 6);
-    if (!ptrName) {
-        FreePooled(record, sizeof(struct DNSRecord));
-        return NULL;
+    if (a->type != b->type) {
+        return a->type < b->type ? -1 : 1;
     }
     
-    /* Format PTR name */
-    sprintf(ptrName, "%s.local", type);
-    
-    /* Initialize record */
-    record->name = ptrName;
-    record->type = DNS_TYPE_PTR;
-    record->class = DNS_CLASS_IN;
-    record->ttl = 120;  /* 2 minutes */
-    
-    /* Copy name */
-    nameCopy = strdup(name);
-    if (!nameCopy) {
-        FreePooled(ptrName, strlen(type) + 6);
-        FreePooled(record, sizeof(struct DNSRecord));
-        return NULL;
+    length = a->rdlength < b->rdlength ? a->rdlength : b->rdlength;
+    result = memcmp(a->rdata, b->rdata, length);
+    if (result != 0) {
+        return result < 0 ? -1 : 1;
     }
-    record->data.ptr.name = nameCopy;
     
-    return record;
+    return (LONG)a->rdlength - (LONG)b->rdlength;
 }
 
-/* Create an SRV record */
-static struct DNSRecord *createSRVRecord(const char *name, UWORD port, const char *host)
+/* Sort a handful of proposed records, lowest first */
+static void sortProposed(struct ProposedRecord *records, LONG count)
 {
-    struct DNSRecord *record = NULL;
-    char *nameCopy = NULL;
-    char *hostCopy = NULL;
-    
-    /* Allocate record */
-    record = AllocPooled(sizeof(struct DNSRecord));
-    if (!record) {
-        return NULL;
-    }
+    struct ProposedRecord record;
+    LONG i, k;
     
-    /* Copy name */
-    nameCopy = strdup(name);
-    if (!nameCopy) {
-        FreePooled(record, sizeof(struct DNSRecord));
-        return NULL;
+    for (i = 1; i < count; i++) {
+        record = records[i];
+        for (k = i; k > 0 && compareProposed(&records[k - 1], &record) > 0; k--) {
+            records[k] = records[k - 1];
+        }
+        records[k] = record;
     }
-    record->name = nameCopy;
-    
-    record->type = DNS_TYPE_SRV;
-    record->class = DNS_CLASS_IN;
-    record->ttl = 120;  /* 2 minutes */
-    record->data.srv.priority = 0;
-    record->data.srv.weight = 0;
-    record->data.srv.port = port;
+}
+
+/* Collect the authority records of a probe for one name, with names in
+ * the RDATA uncompressed into buffer. Returns how many were found. */
+static LONG readProposed(struct DNSMessage *msg, const char *name,
+                         struct ProposedRecord *records, UBYTE *buffer)
+{
+    char owner[BA_MAX_NAME_LEN];
+    char target[BA_MAX_NAME_LEN];
+    struct DNSRDataIter iter;
+    struct DNSRData rd;
+    struct DNSEntry *entry;
+    LONG count = 0;
+    LONG start;
+    LONG len;
+    LONG i;
     
-    /* Copy host */
-    hostCopy = strdup(host);
-    if (!hostCopy) {
-        FreePooled(nameCopy, strlen(name) + 1);
-        FreePooled(record, sizeof(struct DNSRecord));
-        return NULL;
+    for (i = 0; i < msg->numEntries && count < MAX_PROPOSED; i++) {
+        entry = &msg->entries[i];
+        if (entry->section != DNS_SECTION_AUTHORITY ||
+            dnsEntryName(msg, entry, owner, sizeof(owner)) < 0 ||
+            !dnsNameEqual(owner, name)) {
+            continue;
+        }
+        
+        records[count].class = entry->class & 0x7FFF;
+        records[count].type = entry->type;
+        records[count].rdlength = entry->rdlength;
+        records[count].rdata = msg->data + entry->rdoffset;
+        
+        /* Targets may be compressed, they are compared as plain labels */
+        if (entry->type == DNS_TYPE_PTR || entry->type == DNS_TYPE_SRV) {
+            if (dnsEntryRData(msg, entry, &iter) < 0 || dnsRDataNext(&iter, &rd) <= 0 ||
+                dnsReadName(msg->data, msg->length, rd.name, target, sizeof(target),
+                            &msg->names) < 0) {
+                continue;
+            }
+            start = (entry->type == DNS_TYPE_SRV) ? 6 : 0;
+            memcpy(buffer, records[count].rdata, start);
+            len = dnsNameToLabels(target, buffer + start, BA_MAX_NAME_LEN);
+            if (len < 0) {
+                continue;
+            }
+            records[count].rdlength = start + len;
+            records[count].rdata = buffer;
+            buffer += BA_MAX_NAME_LEN + 6;
+        }
+        
+        count++;
     }
-    record->data.srv.target = hostCopy;
     
-    return record;
+    return count;
 }
 
-/* Create a TXT record */
-static struct DNSRecord *createTXTRecord(const char *name, const struct BATXTRecord *txt)
+/* Another host probing for a name we are probing too. The side whose
+ * proposed records sort later wins; the other waits a second and starts
+ * probing again (RFC 6762 8.2). Identical records are our own probe. */
+static void checkProbeTiebreak(struct InterfaceState *iface, struct DNSMessage *msg,
+                               const char *name)
 {
-    struct DNSRecord *record = NULL;
-    struct BATXTRecord *current;
-    LONG length = 0;
-    char *data = NULL;
-    char *nameCopy = NULL;
+    static UBYTE buffer[MAX_PROPOSED][BA_MAX_NAME_LEN + 6];
+    struct ProposedRecord ours[PROPOSED_RECORDS];
+    struct ProposedRecord theirs[MAX_PROPOSED];
+    struct BAServiceNode *service = NULL;
+    struct Probe *probe;
+    LONG numOurs = 0;
+    LONG numTheirs;
+    LONG result = 0;
+    UWORD atom;
+    LONG i;
     
-    /* Allocate record */
-    record = AllocPooled(sizeof(struct DNSRecord));
-    if (!record) {
-        return NULL;
+    atom = findName(name);
+    if (!atom) {
+        return;
     }
     
-    /* Copy name */
-    nameCopy = strdup(name);
-    if (!nameCopy) {
-        FreePooled(record, sizeof(struct DNSRecord));
-        return NULL;
+    for (probe = (struct Probe *)iface->probes.lh_Head;
+         probe->node.ln_Succ;
+         probe = (struct Probe *)probe->node.ln_Succ) {
+        if (probe->service && probe->service->instanceAtom == atom) {
+            service = probe->service;
+            break;
+        }
     }
-    record->name = nameCopy;
-    
-    record->type = DNS_TYPE_TXT;
-    record->class = DNS_CLASS_IN;
-    record->ttl = 120;  /* 2 minutes */
-    
-    /* Calculate total length */
-    for (current = (struct BATXTRecord *)txt; current; current = current->next) {
-        length += strlen(current->key) + strlen(current->value) + 2;
+    if (!service) {
+        return;
     }
     
-    /* Allocate data */
-    data = AllocPooled(length + 1);
-    if (!data) {
-        FreePooled(nameCopy, strlen(name) + 1);
-        FreePooled(record, sizeof(struct DNSRecord));
-        return NULL;
+    /* A query without proposed records is not a probe */
+    numTheirs = readProposed(msg, name, theirs, buffer[0]);
+    if (numTheirs == 0) {
+        return;
     }
     
-    /* Format data */
-    for (current = (struct BATXTRecord *)txt; current; current = current->next) {
-        strcat(data, current->key);
-        strcat(data, "=");
-        strcat(data, current->value);
-        if (current->next) {
-            strcat(data, " ");
+    for (i = 0; i < PROPOSED_RECORDS; i++) {
+        if (service->proposed[i]) {
+            ours[numOurs].class = service->proposed[i]->record.class;
+            ours[numOurs].type = service->proposed[i]->record.type;
+            ours[numOurs].rdlength = service->proposed[i]->record.rdlength;
+            ours[numOurs].rdata = service->proposed[i]->record.rdata;
+            numOurs++;
         }
     }
+    sortProposed(ours, numOurs);
+    sortProposed(theirs, numTheirs);
     
-    record->data.txt.data = data;
-    record->data.txt.length = length;
-    
-    return record;
-}
-
-/* Create a probe question */
-static struct DNSQuestion *createProbeQuestion(const char *name, const char *type)
-{
-    struct DNSQuestion *question;
-    char *questionName;
-    
-    /* Allocate question */
-    question = AllocMem(sizeof(struct DNSQuestion), MEMF_CLEAR);
-    if (!question) {
-        return NULL;
+    /* First difference decides, a longer list beats its own prefix */
+    for (i = 0; i < numOurs && i < numTheirs && result == 0; i++) {
+        result = compareProposed(&ours[i], &theirs[i]);
     }
-    
-    /* Create question name */
-    questionName = AllocMem(strlen(name) + strlen(type) + 8, MEMF_CLEAR);
-    if (!questionName) {
-        FreeMem(question, sizeof(struct DNSQuestion));
-        return NULL;
+    if (result == 0) {
+        result = numOurs - numTheirs;
     }
     
-    /* Format question name */
-    sprintf(questionName, "%s.%s.local", name, type);
-    
-    /* Initialize question */
-    question->name = questionName;
-    question->type = DNS_TYPE_ANY;
-    question->class = DNS_CLASS_IN;
-    question->unicast = FALSE;
-    
-    return question;
+    if (result < 0) {
+        logMessage(LOG_INFO, "Lost simultaneous probe for %s, probing again", name);
+        probe->count = 0;
+        probe->nextTime = getMillis() + PROBE_DEFER;
+        service->probeCount = 0;
+        setTimerBy(&iface->probeTimer, probe->nextTime);
+    }
 }
 
-/* Add a record to an interface */
-static void addRecord(struct InterfaceState *iface, struct DNSRecord *record)
+/* Take a probe off its lists and free it with its query */
+static void freeProbe(struct Probe *probe)
 {
-    /* Add to record list */
-    AddTail(iface->records, (struct Node *)record);
-    
-    /* Schedule announcement */
-    scheduleAnnouncement(iface, record);
+    Remove((struct Node *)probe);
+    Remove((struct Node *)probe->query);
+    FreeMem(probe->query, sizeof(struct DNSQuery));
+    FreeMem(probe, sizeof(struct Probe));
 }
 
-/* Add a question to an interface */
-static void addQuestion(struct InterfaceState *iface, struct DNSQuestion *question)
+/* Free the records a service proposed while probing */
+static void freeProposed(struct BAServiceNode *service)
 {
-    /* Add to question list */
-    AddTail(iface->questions, (struct Node *)question);
+    LONG i;
     
-    /* Schedule query */
-    scheduleQuery(iface, question);
+    for (i = 0; i < PROPOSED_RECORDS; i++) {
+        if (service->proposed[i]) {
+            freeRecord(service->proposed[i]);
+            service->proposed[i] = NULL;
+        }
+    }
 }
 
-/* Remove a record from an interface */
-static void removeRecord(struct InterfaceState *iface, const char *name, UWORD type)
+/* Stop probing for a service that is going away */
+static void cancelProbes(struct BAServiceNode *service)
 {
-    struct DNSRecord *record;
-    struct DNSRecord *next;
+    struct Probe *probe;
+    struct Probe *next;
+    LONG i;
     
-    for (record = (struct DNSRecord *)iface->records.lh_Head;
-         record->node.ln_Succ;
-         record = next) {
-        next = (struct DNSRecord *)record->node.ln_Succ;
-        
-        if (strcmp(record->name, name) == 0 && record->type == type) {
-            /* Remove from list */
-            Remove((struct Node *)record);
-            
-            /* Free memory */
-            FreePooled(record->name, strlen(record->name) + 1);
-            switch (record->type) {
-                case DNS_TYPE_PTR:
-                    FreePooled(record->data.ptr.name, strlen(record->data.ptr.name) + 1);
-                    break;
-                case DNS_TYPE_SRV:
-                    FreePooled(record->data.srv.target, strlen(record->data.srv.target) + 1);
-                    break;
-                case DNS_TYPE_TXT:
-                    FreePooled(record->data.txt.data, record->data.txt.length + 1);
-                    break;
+    for (i = 0; i < bonami.num_interfaces; i++) {
+        for (probe = (struct Probe *)bonami.interfaces[i].probes.lh_Head;
+             probe->node.ln_Succ;
+             probe = next) {
+            next = (struct Probe *)probe->node.ln_Succ;
+            if (probe->service == service) {
+                freeProbe(probe);
             }
-            FreePooled(record, sizeof(struct DNSRecord));
         }
     }
 }
 
-/* Schedule a record announcement */
-static void scheduleAnnouncement(struct InterfaceState *iface, struct DNSRecord *record)
+/* Advertise the records of a service on one more interface. The records
+ * are shared, so only the first interface creates them. */
+static void addServiceRecords(struct InterfaceState *iface, struct BAServiceNode *service)
 {
-    struct Announcement *announce;
+    ULONG bit = IFACE_BIT(iface);
+    struct RecordNode *record;
+    struct MinNode *node;
     
-    /* Allocate announcement */
-    announce = AllocMem(sizeof(struct Announcement), MEMF_CLEAR);
-    if (!announce) {
+    /* SRV targets on this host resolve through the interface address */
+    addHostRecord(iface);
+    
+    service->ifaces |= bit;
+    if (service->dirty || !service->records.mlh_Head->mln_Succ) {
+        buildServiceRecords(service);
         return;
     }
     
-    /* Initialize announcement */
-    announce->record = record;
-    announce->count = 0;
-    announce->nextTime = GetSysTime() + 1;  /* Start in 1 second */
-    
-    /* Add to announcement list */
-    AddTail(iface->announces, (struct Node *)announce);
-}
-
+    for (node = service->records.mlh_Head; node->mln_Succ; node = node->mln_Succ) {
+        record = OWNER_RECORD(node);
+        if (!(record->ifaces & bit)) {
+            record->ifaces |= bit;
+            scheduleAnnouncement(iface, record);
+        }
+    }
+}
+
+/* Put a freshly built record in place of the service's record of the
+ * same type. An unchanged record is kept as it is, so peers see neither
+ * a goodbye nor a new announcement for it (RFC 6762 10.1); it only
+ * follows the service onto new interfaces and off gone ones. */
+static void replaceRecord(struct BAServiceNode *service, struct RecordNode *record)
+{
+    struct RecordNode *old = NULL;
+    struct MinNode *node;
+    ULONG gone;
+    LONG i;
+    
+    for (node = service->records.mlh_Head; node->mln_Succ; node = node->mln_Succ) {
+        if (OWNER_RECORD(node)->record.type == record->record.type) {
+            old = OWNER_RECORD(node);
+            break;
+        }
+    }
+    
+    if (old && old->wireLength == record->wireLength &&
+        memcmp(old->wire, record->wire, record->wireLength) == 0) {
+        freeRecord(record);
+        
+        gone = old->ifaces & ~service->ifaces;
+        if (gone) {
+            withdrawRecord(old, gone);
+        }
+        for (i = 0; i < bonami.num_interfaces; i++) {
+            if ((service->ifaces & ~old->ifaces) & (1UL << i)) {
+                old->ifaces |= 1UL << i;
+                scheduleAnnouncement(&bonami.interfaces[i], old);
+            }
+        }
+        return;
+    }
+    
+    /* Changed, the old data is withdrawn and the new announced */
+    if (old) {
+        dropRecord(old);
+    }
+    addRecord(record, service, service->ifaces);
+}
+
+/* Replace the PTR, SRV and TXT records of a service with ones built from
+ * its current settings, on every interface in service->ifaces */
+static void buildServiceRecords(struct BAServiceNode *service)
+{
+    struct BAService *info = &service->service;
+    const char *host = info->hostname[0] ? info->hostname : bonami.hostname;
+    struct RecordNode *record;
+    char instance[BA_MAX_NAME_LEN];
+    
+    buildInstanceName(instance, info);
+    
+    /* Stays dirty until all three records exist */
+    service->dirty = TRUE;
+    
+    /* Create PTR record */
+    record = createPTRRecord(info->type, instance);
+    if (!record) {
+        return;
+    }
+    replaceRecord(service, record);
+    
+    /* Create SRV record */
+    record = createSRVRecord(instance, info->port, host);
+    if (!record) {
+        return;
+    }
+    replaceRecord(service, record);
+    
+    /* Remember the target, a new host name means a rebuild */
+    releaseName(service->hostAtom);
+    service->hostAtom = internName(host);
+    
+    /* Create TXT record */
+    record = createTXTRecord(instance, info->txt);
+    if (!record) {
+        return;
+    }
+    replaceRecord(service, record);
+    
+    service->dirty = FALSE;
+}
+
+/* Build the full instance name of a service, e.g. "My Printer._ipp._tcp.local" */
+static void buildInstanceName(char *buffer, const struct BAService *service)
+{
+    snprintf(buffer, BA_MAX_NAME_LEN, "%s.%s", service->name, service->type);
+}
+
+/* Allocate a record node with room for its wire form, the name is
+ * interned. Everything but the RDATA is rendered here; the caller fills
+ * record.rdata. */
+static struct RecordNode *allocRecord(const char *name, UWORD type, UWORD rdlength)
+{
+    struct RecordNode *record;
+    UBYTE labels[BA_MAX_NAME_LEN];
+    UBYTE *fixed;
+    ULONG size;
+    LONG nameLen;
+    UWORD atom;
+    
+    nameLen = dnsNameToLabels(name, labels, sizeof(labels));
+    if (nameLen < 0 || nameLen + 10 + rdlength > MAX_PACKET_SIZE) {
+        return NULL;
+    }
+    
+    atom = internName(name);
+    if (!atom) {
+        return NULL;
+    }
+    
+    size = sizeof(struct RecordNode) + nameLen + 10 + rdlength;
+    record = AllocPooled(size);
+    if (!record) {
+        releaseName(atom);
+        return NULL;
+    }
+    
+    memset(record, 0, sizeof(struct RecordNode));
+    record->size = size;
+    record->nameAtom = atom;
+    record->record.name = (char *)atomName(atom);
+    record->record.type = type;
+    record->record.class = DNS_CLASS_IN;
+    record->record.ttl = 120;  /* 2 minutes */
+    record->unique = (type != DNS_TYPE_PTR);
+    record->record.rdlength = rdlength;
+    
+    /* Owner labels, type, class, TTL and RDLENGTH, then the RDATA */
+    record->wire = (UBYTE *)(record + 1);
+    record->wireLength = nameLen + 10 + rdlength;
+    memcpy(record->wire, labels, nameLen);
+    fixed = record->wire + nameLen;
+    fixed[0] = type >> 8;
+    fixed[1] = type & 0xFF;
+    fixed[2] = DNS_CLASS_IN >> 8;
+    fixed[3] = DNS_CLASS_IN & 0xFF;
+    fixed[4] = record->record.ttl >> 24;
+    fixed[5] = (record->record.ttl >> 16) & 0xFF;
+    fixed[6] = (record->record.ttl >> 8) & 0xFF;
+    fixed[7] = record->record.ttl & 0xFF;
+    fixed[8] = rdlength >> 8;
+    fixed[9] = rdlength & 0xFF;
+    record->record.rdata = fixed + 10;
+    
+    return record;
+}
+
+/* Free a record node */
+static void freeRecord(struct RecordNode *record)
+{
+    releaseName(record->nameAtom);
+    releaseName(record->targetAtom);
+    FreePooled(record, record->size);
+}
+
+/* Fold a name to lowercase and hash it, returns the length or -1 if too long */
+static LONG foldName(const char *name, char *folded, ULONG *hash)
+{
+    ULONG h = 2166136261UL;  /* FNV-1a */
+    LONG len;
+    LONG i;
+    
+    len = strlen(name);
+    if (len >= BA_MAX_NAME_LEN) {
+        return -1;
+    }
+    
+    dnsFoldCase((UBYTE *)folded, (const UBYTE *)name, len + 1);
+    for (i = 0; i < len; i++) {
+        h = (h ^ (UBYTE)folded[i]) * 16777619UL;
+    }
+    
+    *hash = h;
+    return len;
+}
+
+/* Look up a folded name in the name table */
+static struct NameAtom *lookupAtom(const char *folded, LONG length, ULONG hash)
+{
+    struct NameAtom *atom;
+    
+    for (atom = bonami.nameHash[hash & (NAME_HASH_SIZE - 1)]; atom; atom = atom->next) {
+        if (atom->hash == hash && atom->length == length &&
+            memcmp(atom->name, folded, length) == 0) {
+            return atom;
+        }
+    }
+    
+    return NULL;
+}
+
+/* Intern a name and take a reference on it, returns 0 on failure */
+static UWORD internName(const char *name)
+{
+    struct NameAtom *atom;
+    char folded[BA_MAX_NAME_LEN];
+    ULONG hash;
+    ULONG size;
+    LONG len;
+    LONG i;
+    UWORD id = 0;
+    
+    len = foldName(name, folded, &hash);
+    if (len < 0) {
+        return 0;
+    }
+    
+    atom = lookupAtom(folded, len, hash);
+    if (atom) {
+        atom->refCount++;
+        return atom->id;
+    }
+    
+    /* Find a free ID, starting after the last one handed out */
+    for (i = 1; i < MAX_NAME_ATOMS; i++) {
+        id = bonami.lastAtom % (MAX_NAME_ATOMS - 1) + 1;
+        bonami.lastAtom = id;
+        if (!bonami.atoms[id]) {
+            break;
+        }
+    }
+    if (i == MAX_NAME_ATOMS) {
+        logMessage(LOG_ERROR, "Name table full");
+        return 0;
+    }
+    
+    /* Canonical and display text share one allocation */
+    size = sizeof(struct NameAtom) + 2 * len + 1;
+    atom = AllocPooled(size);
+    if (!atom) {
+        return 0;
+    }
+    
+    atom->hash = hash;
+    atom->refCount = 1;
+    atom->size = size;
+    atom->id = id;
+    atom->length = len;
+    memcpy(atom->name, folded, len + 1);
+    atom->display = atom->name + len + 1;
+    memcpy(atom->display, name, len + 1);
+    
+    atom->next = bonami.nameHash[hash & (NAME_HASH_SIZE - 1)];
+    bonami.nameHash[hash & (NAME_HASH_SIZE - 1)] = atom;
+    bonami.atoms[id] = atom;
+    
+    return id;
+}
+
+/* Find the atom of a name without interning it, returns 0 if unknown */
+static UWORD findName(const char *name)
+{
+    struct NameAtom *atom;
+    char folded[BA_MAX_NAME_LEN];
+    ULONG hash;
+    LONG len;
+    
+    len = foldName(name, folded, &hash);
+    if (len < 0) {
+        return 0;
+    }
+    
+    atom = lookupAtom(folded, len, hash);
+    return atom ? atom->id : 0;
+}
+
+/* Drop a reference on an interned name */
+static void releaseName(UWORD id)
+{
+    struct NameAtom *atom;
+    struct NameAtom **link;
+    
+    if (!id || !(atom = bonami.atoms[id])) {
+        return;
+    }
+    
+    if (--atom->refCount > 0) {
+        return;
+    }
+    
+    /* Unlink from the hash chain */
+    for (link = &bonami.nameHash[atom->hash & (NAME_HASH_SIZE - 1)];
+         *link != atom;
+         link = &(*link)->next);
+    *link = atom->next;
+    
+    bonami.atoms[id] = NULL;
+    FreePooled(atom, atom->size);
+}
+
+/* Get the display text of an interned name */
+static const char *atomName(UWORD id)
+{
+    struct NameAtom *atom = id ? bonami.atoms[id] : NULL;
+    
+    return atom ? atom->display : "";
+}
+
+/* Create a PTR record */
+static struct RecordNode *createPTRRecord(const char *type, const char *instance)
+{
+    struct RecordNode *record;
+    UBYTE labels[BA_MAX_NAME_LEN];
+    LONG len;
+    
+    /* RDATA is the instance name in label form */
+    len = dnsNameToLabels(instance, labels, sizeof(labels));
+    if (len < 0) {
+        return NULL;
+    }
+    
+    record = allocRecord(type, DNS_TYPE_PTR, len);
+    if (!record) {
+        return NULL;
+    }
+    
+    memcpy(record->record.rdata, labels, len);
+    
+    /* The target leads to the SRV and TXT records */
+    record->targetAtom = internName(instance);
+    if (!record->targetAtom) {
+        freeRecord(record);
+        return NULL;
+    }
+    
+    return record;
+}
+
+/* Create an SRV record */
+static struct RecordNode *createSRVRecord(const char *instance, UWORD port, const char *host)
+{
+    struct RecordNode *record;
+    UBYTE labels[BA_MAX_NAME_LEN];
+    UBYTE *rdata;
+    LONG len;
+    
+    /* RDATA is priority, weight, port and the target host */
+    len = dnsNameToLabels(host, labels, sizeof(labels));
+    if (len < 0) {
+        return NULL;
+    }
+    
+    record = allocRecord(instance, DNS_TYPE_SRV, 6 + len);
+    if (!record) {
+        return NULL;
+    }
+    
+    rdata = record->record.rdata;
+    rdata[0] = 0;  /* Priority */
+    rdata[1] = 0;
+    rdata[2] = 0;  /* Weight */
+    rdata[3] = 0;
+    rdata[4] = port >> 8;
+    rdata[5] = port & 0xFF;
+    memcpy(rdata + 6, labels, len);
+    
+    /* The target leads to the host address */
+    record->targetAtom = internName(host);
+    if (!record->targetAtom) {
+        freeRecord(record);
+        return NULL;
+    }
+    
+    return record;
+}
+
+/* Create a TXT record */
+static struct RecordNode *createTXTRecord(const char *instance, const struct BATXTRecord *txt)
+{
+    struct RecordNode *record;
+    const struct BATXTRecord *current;
+    UBYTE *rdata;
+    ULONG length = 0;
+    ULONG keyLen;
+    ULONG valueLen;
+    
+    /* Each key=value pair is one length-prefixed string */
+    for (current = txt; current; current = current->next) {
+        keyLen = strlen(current->key);
+        valueLen = strlen(current->value);
+        if (keyLen + 1 + valueLen > 255) {
+            return NULL;
+        }
+        length += 1 + keyLen + 1 + valueLen;
+    }
+    
+    /* An empty TXT record holds a single empty string */
+    if (length == 0) {
+        length = 1;
+    }
+    
+    if (length > 0xFFFF) {
+        return NULL;
+    }
+    
+    record = allocRecord(instance, DNS_TYPE_TXT, length);
+    if (!record) {
+        return NULL;
+    }
+    
+    rdata = record->record.rdata;
+    rdata[0] = 0;
+    for (current = txt; current; current = current->next) {
+        keyLen = strlen(current->key);
+        valueLen = strlen(current->value);
+        *rdata++ = keyLen + 1 + valueLen;
+        memcpy(rdata, current->key, keyLen);
+        rdata += keyLen;
+        *rdata++ = '=';
+        memcpy(rdata, current->value, valueLen);
+        rdata += valueLen;
+    }
+    
+    return record;
+}
+
+/* Create an A record for one of our addresses */
+static struct RecordNode *createARecord(const char *host, struct in_addr addr)
+{
+    struct RecordNode *record;
+    
+    record = allocRecord(host, DNS_TYPE_A, 4);
+    if (!record) {
+        return NULL;
+    }
+    
+    /* s_addr is already in network order */
+    memcpy(record->record.rdata, &addr.s_addr, 4);
+    
+    return record;
+}
+
+/* Advertise the host address on an interface. Addresses differ between
+ * interfaces, so each has its own A record. */
+static void addHostRecord(struct InterfaceState *iface)
+{
+    ULONG bit = IFACE_BIT(iface);
+    struct RecordNode *record;
+    UWORD atom;
+    
+    if (!bonami.hostname[0]) {
+        return;
+    }
+    
+    atom = findName(bonami.hostname);
+    for (record = atom ? bonami.recordHash[RECORD_HASH(atom)] : NULL;
+         record;
+         record = record->hashNext) {
+        if (record->nameAtom == atom && record->record.type == DNS_TYPE_A &&
+            (record->ifaces & bit)) {
+            if (memcmp(record->record.rdata, &iface->addr.s_addr, 4) == 0) {
+                return;
+            }
+            
+            /* The address changed */
+            dropRecord(record);
+            break;
+        }
+    }
+    
+    record = createARecord(bonami.hostname, iface->addr);
+    if (record) {
+        addRecord(record, NULL, bit);
+    }
+}
+
+/* Create a probe question for a service instance name */
+static struct DNSQuery *createProbeQuestion(const char *instance)
+{
+    struct DNSQuery *query;
+    
+    /* Allocate query */
+    query = AllocMem(sizeof(struct DNSQuery), MEMF_CLEAR);
+    if (!query) {
+        return NULL;
+    }
+    
+    /* Initialize query */
+    strncpy(query->name, instance, sizeof(query->name) - 1);
+    query->type = DNS_TYPE_ANY;
+    query->class = DNS_CLASS_IN;
+    
+    return query;
+}
+
+/* Add a record to the store and announce it on each interface in
+ * ifaces, owner may be NULL */
+static void addRecord(struct RecordNode *record, struct BAServiceNode *owner, ULONG ifaces)
+{
+    struct RecordNode **bucket = &bonami.recordHash[RECORD_HASH(record->nameAtom)];
+    LONG i;
+    
+    /* Add to record list and indexes */
+    AddTail(&bonami.records, (struct Node *)record);
+    record->hashNext = *bucket;
+    *bucket = record;
+    record->ifaces = ifaces;
+    record->owner = owner;
+    if (owner) {
+        AddTail((struct List *)&owner->records, (struct Node *)&record->ownerNode);
+    }
+    
+    /* Schedule announcements */
+    for (i = 0; i < bonami.num_interfaces; i++) {
+        if (ifaces & (1UL << i)) {
+            scheduleAnnouncement(&bonami.interfaces[i], record);
+        }
+    }
+}
+
+/* Add a question to an interface, it is first sent at start. service
+ * is the service it probes for, or NULL. */
+static void addQuestion(struct InterfaceState *iface, struct DNSQuery *query,
+                        struct BAServiceNode *service, ULONG start)
+{
+    /* Add to question list */
+    AddTail(&iface->questions, (struct Node *)query);
+    
+    /* Schedule query */
+    scheduleQuery(iface, query, service, start);
+}
+
+/* Take a record out of the record list and indexes */
+static void unlinkRecord(struct RecordNode *record)
+{
+    struct RecordNode **link = &bonami.recordHash[RECORD_HASH(record->nameAtom)];
+    
+    while (*link != record) {
+        link = &(*link)->hashNext;
+    }
+    *link = record->hashNext;
+    
+    if (record->owner) {
+        Remove((struct Node *)&record->ownerNode);
+    }
+    if (record->announceIfaces) {
+        Remove((struct Node *)&record->announceNode);
+        record->announceIfaces = 0;
+    }
+    Remove((struct Node *)record);
+}
+
+/* Withdraw a record from some of its interfaces and cancel what is
+ * queued for it there */
+static void withdrawRecord(struct RecordNode *record, ULONG ifaces)
+{
+    struct InterfaceState *iface;
+    LONG i;
+    
+    /* Stop announcing it there */
+    if (record->announceIfaces) {
+        record->announceIfaces &= ~ifaces;
+        if (!record->announceIfaces) {
+            Remove((struct Node *)&record->announceNode);
+        }
+    }
+    
+    for (i = 0; i < bonami.num_interfaces; i++) {
+        if (!(record->ifaces & ifaces & (1UL << i))) {
+            continue;
+        }
+        iface = &bonami.interfaces[i];
+        
+        forgetAnswer(&iface->pending, record);
+        queueGoodbye(iface, record);
+    }
+    
+    record->ifaces &= ~ifaces;
+}
+
+/* Tell peers a record is gone by sending it with TTL 0 (RFC 6762 10.1).
+ * Goodbyes collect in one writer per interface and go out together on
+ * the next timer pass, so removing many records takes few packets. */
+static void queueGoodbye(struct InterfaceState *iface, struct RecordNode *record)
+{
+    static UBYTE wire[MAX_PACKET_SIZE];
+    UBYTE *ttl;
+    
+    /* Nothing to take back if it was never sent */
+    if (!record->lastMulticast || !iface->active || !iface->online) {
+        return;
+    }
+    
+    memcpy(wire, record->wire, record->wireLength);
+    ttl = wire + record->wireLength - record->record.rdlength - 6;
+    ttl[0] = ttl[1] = ttl[2] = ttl[3] = 0;
+    
+    if (dnsWriterAddWire(&iface->goodbyes, DNS_SECTION_ANSWER, wire,
+                         record->wireLength) < 0) {
+        logMessage(LOG_ERROR, "Failed to encode goodbye for %s", record->record.name);
+        return;
+    }
+    
+    if (!iface->goodbyeTimer.armed) {
+        setTimer(&iface->goodbyeTimer, getMillis());
+    }
+}
+
+/* Send the goodbyes queued on an interface */
+static void flushGoodbyes(APTR data)
+{
+    struct InterfaceState *iface = data;
+    
+    clearTimer(&iface->goodbyeTimer);
+    dnsWriterFlush(&iface->goodbyes);
+}
+
+/* Withdraw a record from all its interfaces and free it */
+static void dropRecord(struct RecordNode *record)
+{
+    withdrawRecord(record, record->ifaces);
+    unlinkRecord(record);
+    freeRecord(record);
+}
+
+/* Schedule a record announcement on one interface. The state lives in
+ * the record, one sequence per interface, so other interfaces partway
+ * through theirs carry on unchanged. */
+static void scheduleAnnouncement(struct InterfaceState *iface, struct RecordNode *record)
+{
+    LONG i = iface - bonami.interfaces;
+    
+    if (!record->announceIfaces) {
+        AddTail((struct List *)&bonami.announcing, (struct Node *)&record->announceNode);
+    }
+    record->announceIfaces |= IFACE_BIT(iface);
+    record->announceCount[i] = 0;
+    record->announceNext[i] = getMillis();  /* First one goes out at once */
+    
+    setTimerBy(&bonami.announceTimer, record->announceNext[i]);
+}
+
 /* Schedule a question query */
-static void scheduleQuery(struct InterfaceState *iface, struct DNSQuestion *question)
+static void scheduleQuery(struct InterfaceState *iface, struct DNSQuery *query,
+                          struct BAServiceNode *service, ULONG start)
 {
     struct Probe *probe;
     
+    /* Join the next step of the probes already running, so that every
+     * name being probed on the interface shares one packet per step */
+    for (probe = (struct Probe *)iface->probes.lh_Head;
+         probe->node.ln_Succ;
+         probe = (struct Probe *)probe->node.ln_Succ) {
+        if ((LONG)(probe->nextTime - start) >= 0 &&
+            (LONG)(probe->nextTime - start) < PROBE_WAIT) {
+            start = probe->nextTime;
+            break;
+        }
+    }
+    
     /* Allocate probe */
     probe = AllocMem(sizeof(struct Probe), MEMF_CLEAR);
     if (!probe) {
@@ -1381,75 +2404,273 @@ static void scheduleQuery(struct InterfaceState *iface, struct DNSQuestion *ques
     }
     
     /* Initialize probe */
-    probe->question = question;
+    probe->query = query;
+    probe->service = service;
     probe->count = 0;
-    probe->nextTime = GetSysTime() + 1;  /* Start in 1 second */
+    probe->nextTime = start;
     
     /* Add to probe list */
-    AddTail(iface->probes, (struct Node *)probe);
+    AddTail(&iface->probes, (struct Node *)probe);
+    setTimerBy(&iface->probeTimer, probe->nextTime);
 }
 
-/* Network monitor task */
-static void networkMonitorTask(void)
+/* Bytes a probe takes at most: its question and proposed records */
+static LONG probeSize(const struct Probe *probe)
 {
-    struct InterfaceState *iface;
+    LONG size = strlen(probe->query->name) + 2 + 4;
     LONG i;
     
-    while (bonami.running) {
-        /* Check network status */
-        if (checkNetworkStatus() != BA_OK) {
-            /* Network is down, wait before retrying */
-            Delay(50);
+    for (i = 0; probe->service && i < PROPOSED_RECORDS; i++) {
+        if (probe->service->proposed[i]) {
+            size += probe->service->proposed[i]->wireLength;
+        }
+    }
+    
+    return size;
+}
+
+/* Write the questions of some probes, then their proposed records in
+ * the authority section (RFC 6762 8.2) */
+static void writeProbes(struct DNSPacketWriter *writer, struct Probe **probes, LONG count)
+{
+    struct DNSQuestion question;
+    struct RecordNode *record;
+    LONG i, k;
+    
+    for (i = 0; i < count; i++) {
+        question.qname = probes[i]->query->name;
+        question.qtype = probes[i]->query->type;
+        question.qclass = probes[i]->query->class;
+        if (dnsWriterAddQuestion(writer, &question) < 0) {
+            logMessage(LOG_ERROR, "Failed to encode probe for %s", question.qname);
+        }
+    }
+    
+    for (i = 0; i < count; i++) {
+        for (k = 0; probes[i]->service && k < PROPOSED_RECORDS; k++) {
+            record = probes[i]->service->proposed[k];
+            if (record && dnsWriterAddWire(writer, DNS_SECTION_AUTHORITY, record->wire,
+                                           record->wireLength) < 0) {
+                logMessage(LOG_ERROR, "Failed to encode proposed record for %s",
+                           record->record.name);
+            }
+        }
+    }
+}
+
+/* Send every probe that is due. All names in the same probing step go
+ * out together, each packet holding as many questions as fit with their
+ * proposed records. A batch of services shares its probe packets, and
+ * its announcements once probing ends. */
+static void processProbes(APTR data)
+{
+    struct InterfaceState *iface = data;
+    struct DNSPacketWriter writer;
+    struct BAServiceNode *service;
+    struct Probe *batch[MAX_PROBE_BATCH];
+    struct Probe *probe;
+    struct Probe *next;
+    UBYTE buffer[DNS_DEFAULT_BUDGET];
+    ULONG now = getMillis();
+    LONG numBatch = 0;
+    LONG size = DNS_HEADER_SIZE;
+    LONG need;
+    
+    dnsWriterInit(&writer, buffer, sizeof(buffer), 0, sendPacket, iface);
+    
+    for (probe = (struct Probe *)iface->probes.lh_Head;
+         probe->node.ln_Succ;
+         probe = next) {
+        next = (struct Probe *)probe->node.ln_Succ;
+        if ((LONG)(probe->nextTime - now) > 0) {
+            setTimerBy(&iface->probeTimer, probe->nextTime);
             continue;
         }
         
-        /* Check all interfaces */
-        for (i = 0; i < bonami.num_interfaces; i++) {
-            iface = &bonami.interfaces[i];
-            if (checkInterface(iface) != BA_OK) {
-                /* Interface is down, wait before retrying */
-                Delay(50);
-                continue;
+        /* No conflict in PROBE_WAIT after the last probe, the name is ours */
+        if (probe->count >= PROBE_NUM) {
+            service = probe->service;
+            freeProbe(probe);
+            if (service) {
+                freeProposed(service);
+                service->state = 1;
+                service->announceCount = 0;
+                startServiceAnnouncement(iface, service);
+                if (service->callback) {
+                    service->callback(&service->service, BA_OK, service->userData);
+                }
             }
-            
-            /* Update interface services */
-            updateInterfaceServices(iface);
+            continue;
+        }
+        
+        /* A question and its proposed records must share a packet */
+        need = probeSize(probe);
+        if (numBatch == MAX_PROBE_BATCH ||
+            (numBatch > 0 && size + need > DNS_DEFAULT_BUDGET)) {
+            writeProbes(&writer, batch, numBatch);
+            dnsWriterFlush(&writer);
+            numBatch = 0;
+            size = DNS_HEADER_SIZE;
         }
+        batch[numBatch++] = probe;
+        size += need;
         
-        /* Wait before next check */
-        Delay(50);
+        probe->count++;
+        if (probe->service) {
+            probe->service->probeCount = probe->count;
+        }
+        probe->nextTime = now + PROBE_WAIT;
+        setTimerBy(&iface->probeTimer, probe->nextTime);
     }
+    
+    writeProbes(&writer, batch, numBatch);
+    dnsWriterFlush(&writer);
 }
 
-/* Discovery task */
-static void discoveryTask(void)
+/* Send every announcement that is due, one packed unsolicited response
+ * per interface. Each record is sent ANNOUNCE_NUM times on each of its
+ * interfaces, the gap starting at ANNOUNCE_WAIT and doubling (RFC 6762
+ * 8.3). A record only moves on once its packet went out; otherwise it
+ * is tried again after ANNOUNCE_WAIT. */
+static void processAnnouncements(APTR data)
 {
     struct InterfaceState *iface;
-    struct DNSQuery *query;
+    struct DNSPacketWriter writer;
+    struct AnnounceTarget target;
+    struct RecordNode *record;
+    struct MinNode *node;
+    struct MinNode *next;
+    UBYTE buffer[DNS_DEFAULT_BUDGET];
+    ULONG now = getMillis();
+    ULONG written;
+    ULONG bit;
     LONG i;
     
-    while (bonami.running) {
-        /* Process all interfaces */
-        for (i = 0; i < bonami.num_interfaces; i++) {
-            iface = &bonami.interfaces[i];
-            if (!iface->active) {
+    for (i = 0; i < bonami.num_interfaces; i++) {
+        iface = &bonami.interfaces[i];
+        bit = 1UL << i;
+        target.iface = iface;
+        target.failed = 0xFFFFFFFFUL;  /* Nothing goes out on an interface that is down */
+        target.packets = 0;
+        
+        if (iface->active && iface->online) {
+            target.failed = 0;
+            dnsWriterInit(&writer, buffer, sizeof(buffer), DNS_FLAG_QR | DNS_FLAG_AA,
+                          sendAnnouncement, &target);
+            
+            for (node = bonami.announcing.mlh_Head; node->mln_Succ; node = node->mln_Succ) {
+                record = ANNOUNCE_RECORD(node);
+                if (!(record->announceIfaces & record->ifaces & bit) ||
+                    (LONG)(record->announceNext[i] - now) > 0) {
+                    continue;
+                }
+                
+                if (dnsWriterAddWire(&writer, DNS_SECTION_ANSWER, record->wire,
+                                     record->wireLength) < 0) {
+                    logMessage(LOG_ERROR, "Failed to encode announcement for %s",
+                               record->record.name);
+                    
+                    /* Too big for any packet, or tried again later */
+                    if (record->wireLength > DNS_DEFAULT_BUDGET - DNS_HEADER_SIZE) {
+                        record->announceIfaces &= ~bit;
+                    } else {
+                        record->announceNext[i] = now + ANNOUNCE_WAIT;
+                    }
+                } else {
+                    record->announcePacket = writer.packets;
+                }
+            }
+            
+            /* Failures are collected in target.failed */
+            dnsWriterFlush(&writer);
+        }
+        
+        /* Move the records whose packet was sent on to their next announcement */
+        for (node = bonami.announcing.mlh_Head; node->mln_Succ; node = node->mln_Succ) {
+            record = ANNOUNCE_RECORD(node);
+            if (!(record->announceIfaces & bit) ||
+                (LONG)(record->announceNext[i] - now) > 0) {
                 continue;
             }
             
-            /* Process service states */
-            processServiceStates(iface);
+            if (!(record->ifaces & bit) ||
+                (target.failed & PACKET_BIT(record->announcePacket))) {
+                record->announceNext[i] = now + ANNOUNCE_WAIT;
+                continue;
+            }
             
-            /* Process DNS queries */
-            while ((query = getNextQuery(iface)) != NULL) {
-                if (processDNSQuery(query) != BA_OK) {
-                    /* Query failed, try again later */
-                    requeueQuery(iface, query);
-                }
+            record->lastMulticast = now;
+            written = ++record->announceCount[i];
+            if (written >= ANNOUNCE_NUM) {
+                record->announceIfaces &= ~bit;
+            } else {
+                record->announceNext[i] = now + (ANNOUNCE_WAIT << (written - 1));
             }
         }
-        
-        /* Wait before next check */
-        Delay(10);
+    }
+    
+    /* Drop finished records and wait for the earliest remaining one */
+    for (node = bonami.announcing.mlh_Head; node->mln_Succ; node = next) {
+        next = node->mln_Succ;
+        record = ANNOUNCE_RECORD(node);
+        if (!record->announceIfaces) {
+            Remove((struct Node *)node);
+            continue;
+        }
+        for (i = 0; i < bonami.num_interfaces; i++) {
+            if (record->announceIfaces & (1UL << i)) {
+                setTimerBy(&bonami.announceTimer, record->announceNext[i]);
+            }
+        }
+    }
+}
+
+/* Check the interfaces and the records that depend on them, then
+ * again after INTERFACE_CHECK_INTERVAL */
+static void recheckInterfaces(APTR data)
+{
+    struct InterfaceState *iface;
+    LONG i;
+    
+    checkInterfaces();
+    
+    if (checkNetworkStatus() == BA_OK) {
+        for (i = 0; i < bonami.num_interfaces; i++) {
+            iface = &bonami.interfaces[i];
+            if (checkInterface(iface) == BA_OK) {
+                updateInterfaceServices(iface);
+            }
+        }
+    }
+    
+    setTimer(&bonami.checkTimer, getMillis() + INTERFACE_CHECK_INTERVAL * 1000);
+}
+
+/* Ask for the instances of a discovered type on every interface, at
+ * doubling intervals (RFC 6762 5.2) */
+static void sendDiscoveryQuery(APTR data)
+{
+    struct BADiscoveryNode *discovery = data;
+    struct InterfaceState *iface;
+    struct DNSQuery query;
+    LONG i;
+    
+    memset(&query, 0, sizeof(query));
+    strncpy(query.name, discovery->discovery.type, sizeof(query.name) - 1);
+    query.type = DNS_TYPE_PTR;
+    query.class = DNS_CLASS_IN;
+    
+    for (i = 0; i < bonami.num_interfaces; i++) {
+        iface = &bonami.interfaces[i];
+        if (iface->active && iface->online) {
+            sendQuery(iface, &query);
+        }
+    }
+    
+    setTimer(&discovery->queryTimer, getMillis() + discovery->queryInterval);
+    discovery->queryInterval *= 2;
+    if (discovery->queryInterval > QUERY_INTERVAL_MAX) {
+        discovery->queryInterval = QUERY_INTERVAL_MAX;
     }
 }
 
@@ -1544,46 +2765,60 @@ static LONG checkNetworkStatus(void)
     return BA_ERROR;
 }
 
-/* Update service records */
+/* Bring the records of a service up to date. They are only rebuilt when
+ * the service data or the host name changed, and only announced on
+ * interfaces that did not carry them yet; an unchanged service costs a
+ * few lookups and no allocation. */
 static void updateServiceRecords(struct BAServiceNode *service)
 {
     struct InterfaceState *iface;
-    struct DNSRecord *record;
+    struct RecordNode *record;
+    struct MinNode *node;
+    const char *host;
+    ULONG ifaces = 0;
+    ULONG gone;
     LONG i;
     
-    /* Update records on all interfaces */
+    /* Records are published once probing is over */
+    if (service->state == 0) {
+        return;
+    }
+    
+    /* Active interfaces, their A records follow address changes */
     for (i = 0; i < bonami.num_interfaces; i++) {
         iface = &bonami.interfaces[i];
-        if (!iface->active) {
-            continue;
-        }
-        
-        /* Remove old records */
-        for (record = (struct DNSRecord *)iface->records.lh_Head;
-             record->node.ln_Succ;
-             record = (struct DNSRecord *)record->node.ln_Succ) {
-            if (strcmp(record->name, service->service.name) == 0) {
-                removeRecord(iface, record->name, record->type);
-            }
-        }
-        
-        /* Add new records */
-        record = createPTRRecord(service->service.type, service->service.name);
-        if (record) {
-            addRecord(iface, record);
-            scheduleAnnouncement(iface, record);
+        if (iface->active) {
+            addHostRecord(iface);
+            ifaces |= IFACE_BIT(iface);
         }
-        
-        record = createSRVRecord(service->service.name, service->service.port, bonami.hostname);
-        if (record) {
-            addRecord(iface, record);
-            scheduleAnnouncement(iface, record);
+    }
+    
+    host = service->service.hostname[0] ? service->service.hostname : bonami.hostname;
+    if (service->hostAtom != findName(host)) {
+        service->dirty = TRUE;
+    }
+    
+    if (service->dirty) {
+        service->ifaces = ifaces;
+        buildServiceRecords(service);
+        return;
+    }
+    
+    /* Interfaces that went away */
+    gone = service->ifaces & ~ifaces;
+    if (gone) {
+        for (node = service->records.mlh_Head; node->mln_Succ; node = node->mln_Succ) {
+            record = OWNER_RECORD(node);
+            withdrawRecord(record, gone);
         }
-        
-        record = createTXTRecord(service->service.name, service->service.txt);
-        if (record) {
-            addRecord(iface, record);
-            scheduleAnnouncement(iface, record);
+        service->ifaces &= ~gone;
+    }
+    
+    /* Interfaces that are new */
+    for (i = 0; i < bonami.num_interfaces; i++) {
+        iface = &bonami.interfaces[i];
+        if ((ifaces & ~service->ifaces) & IFACE_BIT(iface)) {
+            addServiceRecords(iface, service);
         }
     }
 }
@@ -1591,37 +2826,41 @@ static void updateServiceRecords(struct BAServiceNode *service)
 /* Process DNS query */
 static LONG processDNSQuery(struct DNSQuery *query)
 {
-    struct DNSRecord *record;
-    struct DNSQuestion *question;
+    struct RecordNode *record;
+    struct DNSQuery *pending;
     struct InterfaceState *iface;
+    UWORD atom;
     LONG i;
     
+    /* Records can only match a name that has been interned */
+    atom = findName(query->name);
+    
+    /* Check records */
+    for (record = atom ? bonami.recordHash[RECORD_HASH(atom)] : NULL;
+         record;
+         record = record->hashNext) {
+        if (record->nameAtom == atom &&
+            record->record.type == query->type &&
+            record->record.class == query->class) {
+            /* Found matching record */
+            return BA_OK;
+        }
+    }
+    
     /* Process all interfaces */
     for (i = 0; i < bonami.num_interfaces; i++) {
         iface = &bonami.interfaces[i];
-        if (!iface->active) {
-            continue;
-        }
-        
-        /* Check records */
-        for (record = (struct DNSRecord *)iface->records.lh_Head;
-             record->node.ln_Succ;
-             record = (struct DNSRecord *)record->node.ln_Succ) {
-            if (strcmp(record->name, query->name) == 0 &&
-                record->type == query->type &&
-                record->class == query->class) {
-                /* Found matching record */
-                return BA_OK;
-            }
+        if (!iface->active) {
+            continue;
         }
         
         /* Check questions */
-        for (question = (struct DNSQuestion *)iface->questions.lh_Head;
-             question->node.ln_Succ;
-             question = (struct DNSQuestion *)question->node.ln_Succ) {
-            if (strcmp(question->name, query->name) == 0 &&
-                question->type == query->type &&
-                question->class == query->class) {
+        for (pending = (struct DNSQuery *)iface->questions.lh_Head;
+             pending->node.ln_Succ;
+             pending = (struct DNSQuery *)pending->node.ln_Succ) {
+            if (dnsNameEqual(pending->name, query->name) &&
+                pending->type == query->type &&
+                pending->class == query->class) {
                 /* Found matching question */
                 return BA_OK;
             }
@@ -1706,7 +2945,7 @@ static LONG validateTXTRecord(const struct BATXTRecord *txt)
         // Check for duplicate keys
         const struct BATXTRecord *check;
         for (check = txt; check != current; check = check->next) {
-            if (strcmp(check->key, current->key) == 0)
+            if (dnsNameEqual(check->key, current->key))
                 return BA_BADTXT;
         }
     }
@@ -1819,9 +3058,14 @@ static LONG initInterfaces(void)
         /* Initialize lists */
         NewList(&iface->services);
         NewList(&iface->probes);
-        NewList(&iface->announces);
-        NewList(&iface->records);
         NewList(&iface->questions);
+        initResponse(&iface->pending);
+        initTimer(&iface->pendingTimer, processPendingResponse, iface);
+        initTimer(&iface->probeTimer, processProbes, iface);
+        initTimer(&iface->goodbyeTimer, flushGoodbyes, iface);
+        dnsWriterInit(&iface->goodbyes, iface->goodbyeBuffer, sizeof(iface->goodbyeBuffer),
+                      DNS_FLAG_QR | DNS_FLAG_AA, sendPacket, iface);
+        bonami.randomSeed ^= iface->addr.s_addr ^ getMillis();
         
         /* Set interface active */
         iface->active = TRUE;
@@ -1842,20 +3086,54 @@ static LONG initInterfaces(void)
 static void cleanupInterfaces(void)
 {
     struct InterfaceState *iface;
+    struct BAServiceNode *service;
+    struct RecordNode *record;
+    struct Probe *probe;
+    struct DNSQuery *query;
     LONG i;
     
+    /* Withdraw every record while the sockets are still open, peers get
+     * one burst of goodbyes per interface */
+    for (record = (struct RecordNode *)bonami.records.lh_Head;
+         record->node.ln_Succ;
+         record = (struct RecordNode *)record->node.ln_Succ) {
+        withdrawRecord(record, record->ifaces);
+    }
+    for (i = 0; i < bonami.num_interfaces; i++) {
+        flushGoodbyes(&bonami.interfaces[i]);
+    }
+    
     for (i = 0; i < bonami.num_interfaces; i++) {
         iface = &bonami.interfaces[i];
         
         /* Cleanup multicast */
         cleanupMulticast(iface);
         
+        /* Free pending sends, they point at records and queries */
+        clearTimer(&iface->pendingTimer);
+        clearTimer(&iface->probeTimer);
+        while ((probe = (struct Probe *)RemHead(&iface->probes))) {
+            FreeMem(probe, sizeof(struct Probe));
+        }
+        while ((query = (struct DNSQuery *)RemHead(&iface->questions))) {
+            FreeMem(query, sizeof(struct DNSQuery));
+        }
+        
         /* Free lists */
+        iface->pending.numAnswers = 0;
         cleanupList(&iface->services);
-        cleanupList(&iface->probes);
-        cleanupList(&iface->announces);
-        cleanupList(&iface->records);
-        cleanupList(&iface->questions);
+    }
+    
+    /* Records are shared, free them once */
+    while (bonami.records.lh_Head->ln_Succ) {
+        record = (struct RecordNode *)bonami.records.lh_Head;
+        unlinkRecord(record);
+        freeRecord(record);
+    }
+    for (service = (struct BAServiceNode *)bonami.services.lh_Head;
+         service->node.ln_Succ;
+         service = (struct BAServiceNode *)service->node.ln_Succ) {
+        service->ifaces = 0;
     }
     
     bonami.num_interfaces = 0;
@@ -1899,45 +3177,129 @@ static void updateInterfaceServices(struct InterfaceState *iface)
     }
 }
 
-/* Add cache entry */
-static void addCacheEntry(const char *name, WORD type, WORD class,
-                         const struct DNSRecord *record, LONG ttl)
+/* Add cache entry, the RDATA is stored separately */
+static struct CacheEntry *addCacheEntry(const char *name, WORD type, WORD class, LONG ttl)
 {
     struct CacheEntry *entry;
     
     /* Allocate entry */
     entry = AllocMem(sizeof(struct CacheEntry), MEMF_CLEAR);
     if (!entry) {
-        return;
+        return NULL;
     }
     
     /* Initialize entry */
-    entry->name = strdup(name);
-    if (!entry->name) {
+    entry->nameAtom = internName(name);
+    if (!entry->nameAtom) {
         FreeMem(entry, sizeof(struct CacheEntry));
-        return;
+        return NULL;
     }
     
     entry->type = type;
     entry->class = class;
-    entry->data = AllocMem(sizeof(struct DNSRecord), MEMF_CLEAR);
-    if (!entry->data) {
-        FreeMem(entry->name, strlen(name) + 1);
-        FreeMem(entry, sizeof(struct CacheEntry));
-        return;
-    }
-    
-    memcpy(entry->data, record, sizeof(struct DNSRecord));
     entry->ttl = ttl;
-    entry->expires = GetSysTime() + ttl;
+    initTimer(&entry->expiry, expireCacheEntry, entry);
+    setCacheExpiry(entry);
     
     /* Add to cache */
     AddTail(&bonami.cache, (struct Node *)entry);
     
-    /* Update hosts file if needed */
-    if (bonami.updateHosts && type == DNS_TYPE_A && strstr(name, ".local")) {
-        updateHostsFile();
+    return entry;
+}
+
+/* Expire a cache entry after its TTL, a goodbye (TTL 0) after one
+ * second (RFC 6762 10.1) */
+static void setCacheExpiry(struct CacheEntry *entry)
+{
+    entry->ttlLeft = entry->ttl > 0 ? entry->ttl : 1;
+    stepCacheExpiry(entry);
+}
+
+/* Arm the expiry timer for the next piece of the TTL. Long TTLs run down
+ * in CACHE_EXPIRY_STEP pieces, which neither overflow the conversion to
+ * ms nor reach past the end of the wheel. */
+static void stepCacheExpiry(struct CacheEntry *entry)
+{
+    ULONG step = entry->ttlLeft < CACHE_EXPIRY_STEP ? entry->ttlLeft : CACHE_EXPIRY_STEP;
+    
+    entry->ttlLeft -= step;
+    setTimer(&entry->expiry, getMillis() + step * 1000UL);
+}
+
+/* Drop a cache entry whose TTL ran out */
+static void expireCacheEntry(APTR data)
+{
+    struct CacheEntry *entry = data;
+    
+    if (entry->ttlLeft > 0) {
+        stepCacheExpiry(entry);
+        return;
+    }
+    Remove((struct Node *)entry);
+    freeCacheEntry(entry);
+}
+
+/* Store the fields of a received RDATA item in a cache entry */
+static LONG storeCacheData(struct CacheEntry *entry, const struct DNSRData *rd,
+                           const char *target, const UBYTE *rdata, UWORD rdlength)
+{
+    UWORD atom = 0;
+    UBYTE *txt = NULL;
+    
+    switch (entry->type) {
+        case DNS_TYPE_A:
+        case DNS_TYPE_AAAA:
+            memcpy(entry->addr, rd->data, rd->length);
+            return BA_OK;
+            
+        case DNS_TYPE_PTR:
+        case DNS_TYPE_SRV:
+            atom = internName(target);
+            if (!atom) {
+                return BA_NOMEM;
+            }
+            entry->priority = rd->priority;
+            entry->weight = rd->weight;
+            entry->port = rd->port;
+            break;
+            
+        case DNS_TYPE_TXT:
+            /* Kept as received, walked with dnsRDataInit when needed */
+            if (rdlength) {
+                txt = AllocMem(rdlength, MEMF_ANY);
+                if (!txt) {
+                    return BA_NOMEM;
+                }
+                memcpy(txt, rdata, rdlength);
+            }
+            break;
+            
+        default:
+            return BA_BADPARAM;
+    }
+    
+    /* Replace the previous data */
+    releaseName(entry->targetAtom);
+    if (entry->txt) {
+        FreeMem(entry->txt, entry->txtLength);
+    }
+    entry->targetAtom = atom;
+    entry->txt = txt;
+    entry->txtLength = txt ? rdlength : 0;
+    
+    return BA_OK;
+}
+
+/* Free a cache entry that is no longer on the cache list */
+static void freeCacheEntry(struct CacheEntry *entry)
+{
+    clearTimer(&entry->expiry);
+    releaseName(entry->nameAtom);
+    releaseName(entry->targetAtom);
+    if (entry->txt) {
+        FreeMem(entry->txt, entry->txtLength);
     }
+    FreeMem(entry, sizeof(struct CacheEntry));
 }
 
 /* Remove cache entry */
@@ -1946,25 +3308,29 @@ static void removeCacheEntry(const char *name, WORD type, WORD class)
     struct CacheEntry *entry;
     struct CacheEntry *next;
     BOOL updated = FALSE;
+    UWORD atom;
+    
+    atom = findName(name);
+    if (!atom) {
+        return;
+    }
     
     for (entry = (struct CacheEntry *)bonami.cache.lh_Head;
          entry->node.ln_Succ;
          entry = next) {
         next = (struct CacheEntry *)entry->node.ln_Succ;
         
-        if (strcmp(entry->name, name) == 0 &&
+        if (entry->nameAtom == atom &&
             entry->type == type &&
             entry->class == class) {
             /* Remove from cache */
             Remove((struct Node *)entry);
             
             /* Free memory */
-            FreeMem(entry->name, strlen(entry->name) + 1);
-            FreeMem(entry->data, sizeof(struct DNSRecord));
-            FreeMem(entry, sizeof(struct CacheEntry));
+            freeCacheEntry(entry);
             
             /* Mark as updated if it was a .local A record */
-            if (type == DNS_TYPE_A && strstr(name, ".local")) {
+            if (type == DNS_TYPE_A && dnsNameHasSuffix(name, "local")) {
                 updated = TRUE;
             }
         }
@@ -1976,17 +3342,19 @@ static void removeCacheEntry(const char *name, WORD type, WORD class)
     }
 }
 
-/* Find cache entry */
-static struct CacheEntry *findCacheEntry(const char *name, WORD type, WORD class)
+/* Find cache entry, PTR records are shared so their target is part of the key */
+static struct CacheEntry *findCacheEntry(UWORD nameAtom, WORD type, WORD class,
+                                         UWORD targetAtom)
 {
     struct CacheEntry *entry;
     
     for (entry = (struct CacheEntry *)bonami.cache.lh_Head;
          entry->node.ln_Succ;
          entry = (struct CacheEntry *)entry->node.ln_Succ) {
-        if (strcmp(entry->name, name) == 0 &&
+        if (entry->nameAtom == nameAtom &&
             entry->type == type &&
-            entry->class == class) {
+            entry->class == class &&
+            (type != DNS_TYPE_PTR || entry->targetAtom == targetAtom)) {
             return entry;
         }
     }
@@ -1998,20 +3366,9 @@ static struct CacheEntry *findCacheEntry(const char *name, WORD type, WORD class
 static void cleanupCache(void)
 {
     struct CacheEntry *entry;
-    struct CacheEntry *next;
     
-    for (entry = (struct CacheEntry *)bonami.cache.lh_Head;
-         entry->node.ln_Succ;
-         entry = next) {
-        next = (struct CacheEntry *)entry->node.ln_Succ;
-        
-        /* Remove from cache */
-        Remove((struct Node *)entry);
-        
-        /* Free memory */
-        FreeMem(entry->name, strlen(entry->name) + 1);
-        FreeMem(entry->data, sizeof(struct DNSRecord));
-        FreeMem(entry, sizeof(struct CacheEntry));
+    while ((entry = (struct CacheEntry *)RemHead(&bonami.cache))) {
+        freeCacheEntry(entry);
     }
 }
 
@@ -2033,112 +3390,18 @@ static LONG resolveHostname(void)
     /* Copy address */
     memcpy(&bonami.config.address, host->h_addr, host->h_length);
     
-    return BA_OK;
-}
-
-/* Check service conflict */
-static LONG checkServiceConflict(const char *name, const char *type)
-{
-    struct InterfaceState *iface;
-    struct DNSQuery query;
-    LONG i;
-    
-    /* Initialize query */
-    memset(&query, 0, sizeof(query));
-    strncpy(query.name, name, sizeof(query.name) - 1);
-    query.type = DNS_TYPE_ANY;
-    query.class = DNS_CLASS_IN;
-    
-    /* Check all interfaces */
-    for (i = 0; i < bonami.num_interfaces; i++) {
-        iface = &bonami.interfaces[i];
-        if (!iface->active) {
-            continue;
-        }
-        
-        /* Send probe */
-        if (sendQuery(iface, &query) != BA_OK) {
-            continue;
-        }
-        
-        /* Wait for response */
-        Delay(250);
-        
-        /* Check for response */
-        if (processDNSQuery(&query) == BA_OK) {
-            return BA_CONFLICT;
-        }
-    }
+    /* Our records use the first label under .local */
+    snprintf(bonami.hostname, sizeof(bonami.hostname), "%.*s.local",
+             (int)strcspn(host->h_name, "."), host->h_name);
     
     return BA_OK;
 }
 
 /* Start service announcement */
-static void startServiceAnnouncement(struct InterfaceState *iface, struct BAService *service)
-{
-    struct DNSRecord *record;
-    
-    /* Create PTR record */
-    record = createPTRRecord(service->type, service->name);
-    if (!record) {
-        return;
-    }
-    
-    /* Add to interface */
-    addRecord(iface, record);
-    
-    /* Create SRV record */
-    record = createSRVRecord(service->name, service->port, service->host);
-    if (!record) {
-        return;
-    }
-    
-    /* Add to interface */
-    addRecord(iface, record);
-    
-    /* Create TXT record */
-    record = createTXTRecord(service->name, service->txt);
-    if (!record) {
-        return;
-    }
-    
-    /* Add to interface */
-    addRecord(iface, record);
-}
-
-/* Process service states */
-static void processServiceStates(struct InterfaceState *iface)
+static void startServiceAnnouncement(struct InterfaceState *iface, struct BAServiceNode *service)
 {
-    struct BAServiceNode *service;
-    struct BAServiceNode *next;
-    
-    for (service = (struct BAServiceNode *)bonami.services.lh_Head;
-         service->node.ln_Succ;
-         service = next) {
-        next = (struct BAServiceNode *)service->node.ln_Succ;
-        
-        switch (service->state) {
-            case 0:  /* Probing */
-                if (service->probeCount >= 3) {
-                    /* No conflicts found, start announcing */
-                    service->state = 1;
-                    service->announceCount = 0;
-                    startServiceAnnouncement(iface, &service->service);
-                }
-                break;
-                
-            case 1:  /* Announcing */
-                if (service->announceCount >= 3) {
-                    /* Announcement complete */
-                    service->state = 2;
-                }
-                break;
-                
-            case 2:  /* Stable */
-                /* Nothing to do */
-                break;
-        }
-    }
+    /* Records are announced as they are added */
+    addServiceRecords(iface, service);
 }
 
 /* Process update callbacks */
@@ -2149,7 +3412,7 @@ static void processUpdateCallbacks(struct BAService *service)
     for (monitor = (struct BAMonitor *)bonami.monitors.lh_Head;
          monitor->node.ln_Succ;
          monitor = (struct BAMonitor *)monitor->node.ln_Succ) {
-        if (strcmp(monitor->type, service->type) == 0) {
+        if (dnsNameEqual(monitor->type, service->type)) {
             /* Call callback */
             monitor->callback(service, monitor->userData);
         }
@@ -2183,41 +3446,25 @@ static void requeueQuery(struct InterfaceState *iface, struct DNSQuery *query)
 /* Send query */
 static LONG sendQuery(struct InterfaceState *iface, struct DNSQuery *query)
 {
-    struct sockaddr_in addr;
-    struct DNSMessage msg;
+    struct DNSPacketWriter writer;
+    struct DNSQuestion question;
+    UBYTE buffer[DNS_DEFAULT_BUDGET];
     LONG result;
     
-    /* Initialize message */
-    memset(&msg, 0, sizeof(msg));
-    msg.id = rand();
-    msg.flags = DNS_FLAG_QUERY;
-    msg.qdcount = 1;
-    
-    /* Add question */
-    strncpy(msg.questions[0].name, query->name, sizeof(msg.questions[0].name) - 1);
-    msg.questions[0].type = query->type;
-    msg.questions[0].class = query->class;
-    
-    /* Initialize address */
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(MDNS_MULTICAST_ADDR);
-    addr.sin_port = htons(MDNS_PORT);
+    /* Encode question */
+    question.qname = query->name;
+    question.qtype = query->type;
+    question.qclass = query->class;
     
-    /* Send message */
-    #ifdef __amigaos4__
-    result = bonami.IRoadshow->sendto(iface->socket, &msg, sizeof(msg), 0,
-                                     (struct sockaddr *)&addr, sizeof(addr));
-    #else
-    result = sendto(iface->socket, &msg, sizeof(msg), 0,
-                   (struct sockaddr *)&addr, sizeof(addr));
-    #endif
+    dnsWriterInit(&writer, buffer, sizeof(buffer), 0, sendPacket, iface);
+    result = dnsWriterAddQuestion(&writer, &question);
     if (result < 0) {
-        logMessage(LOG_ERROR, "Failed to send query: %s", strerror(errno));
-        return BA_NETWORK;
+        logMessage(LOG_ERROR, "Failed to encode query for %s", query->name);
+        return result;
     }
     
-    return BA_OK;
+    /* Send message */
+    return dnsWriterFlush(&writer);
 }
 
 /* Cleanup list */
@@ -2284,6 +3531,233 @@ static void logMessage(LONG level, const char *format, ...)
     }
 }
 
+/* E-clock time in milliseconds, wraps every 49 days. Only the low word
+ * of the E-clock is read, so this must be called before that wraps, which
+ * takes over a minute even at tens of MHz; the interface check keeps the
+ * main loop waking every few seconds. Compare times by the sign of their
+ * difference. */
+static ULONG getMillis(void)
+{
+    struct EClockVal ev;
+    ULONG perMilli;
+    ULONG ticks;
+    
+    #ifdef __amigaos4__
+    perMilli = bonami.ITimer->ReadEClock(&ev) / 1000;
+    #else
+    perMilli = ReadEClock(&ev) / 1000;
+    #endif
+    ticks = ev.ev_lo - bonami.clockLast + bonami.clockRest;
+    bonami.clockLast = ev.ev_lo;
+    bonami.clockMillis += ticks / perMilli;
+    bonami.clockRest = ticks % perMilli;
+    return bonami.clockMillis;
+}
+
+/* Release timer.device, if initDaemon got that far */
+static void closeClock(void)
+{
+    if (!bonami.clockReq.tr_node.io_Device) {
+        return;
+    }
+    #ifdef __amigaos4__
+    if (bonami.ITimer) {
+        DropInterface((struct Interface *)bonami.ITimer);
+        bonami.ITimer = NULL;
+    }
+    #endif
+    CloseDevice((struct IORequest *)&bonami.clockReq);
+    bonami.clockReq.tr_node.io_Device = NULL;
+}
+
+/* Pseudo-random number in [low, high] for protocol jitter */
+static ULONG randomRange(ULONG low, ULONG high)
+{
+    bonami.randomSeed = bonami.randomSeed * 1103515245UL + 12345UL;
+    return low + (bonami.randomSeed >> 16) % (high - low + 1);
+}
+
+/* Prepare a timer, func is called with data each time it fires */
+static void initTimer(struct Timer *timer, void (*func)(APTR data), APTR data)
+{
+    timer->armed = FALSE;
+    timer->func = func;
+    timer->data = data;
+}
+
+/* Set a timer to fire at due, moving it if it was already set */
+static void setTimer(struct Timer *timer, ULONG due)
+{
+    clearTimer(timer);
+    timer->due = due;
+    timer->armed = TRUE;
+    insertTimer(timer);
+}
+
+/* Set a timer to fire at due unless it is set to fire earlier */
+static void setTimerBy(struct Timer *timer, ULONG due)
+{
+    if (!timer->armed || (LONG)(due - timer->due) < 0) {
+        setTimer(timer, due);
+    }
+}
+
+/* Take a timer out of the wheel */
+static void clearTimer(struct Timer *timer)
+{
+    if (timer->armed) {
+        Remove((struct Node *)&timer->node);
+        timer->armed = FALSE;
+    }
+}
+
+/* Put a timer in the slot of the first level whose span covers its
+ * distance from bonami.timerNow. Level n slots are 64^n ms wide and move
+ * down a level each time the level below wraps. */
+static void insertTimer(struct Timer *timer)
+{
+    ULONG due = timer->due;
+    ULONG delta;
+    LONG level;
+    
+    /* Late timers fire on the next tick */
+    if ((LONG)(due - bonami.timerNow) <= 0) {
+        due = bonami.timerNow + 1;
+    }
+    delta = due - bonami.timerNow;
+    
+    /* Beyond the wheel, wait in the farthest slot and be placed again */
+    if (delta >= 1UL << (WHEEL_BITS * WHEEL_LEVELS)) {
+        due = bonami.timerNow + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        delta = due - bonami.timerNow;
+    }
+    
+    for (level = 0; delta >= 1UL << (WHEEL_BITS * (level + 1)); level++);
+    
+    AddTail((struct List *)&bonami.timerSlots[level][(due >> (WHEEL_BITS * level)) &
+                                                     (WHEEL_SIZE - 1)],
+            (struct Node *)&timer->node);
+}
+
+/* Fire every timer due up to now, one millisecond slot at a time */
+static void runTimers(ULONG now)
+{
+    struct MinList fired;
+    struct MinList *slot;
+    struct Timer *timer;
+    LONG level;
+    
+    NewList((struct List *)&fired);
+    
+    while ((LONG)(now - bonami.timerNow) > 0) {
+        bonami.timerNow++;
+        
+        /* A level that wrapped pulls the next slot of the level above down */
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (bonami.timerNow & ((1UL << (WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+            slot = &bonami.timerSlots[level][(bonami.timerNow >> (WHEEL_BITS * level)) &
+                                              (WHEEL_SIZE - 1)];
+            while ((timer = (struct Timer *)RemHead((struct List *)slot))) {
+                insertTimer(timer);
+            }
+        }
+        
+        /* Callbacks may set timers, including ones for this same tick */
+        slot = &bonami.timerSlots[0][bonami.timerNow & (WHEEL_SIZE - 1)];
+        while ((timer = (struct Timer *)RemHead((struct List *)slot))) {
+            AddTail((struct List *)&fired, (struct Node *)&timer->node);
+        }
+        while ((timer = (struct Timer *)RemHead((struct List *)&fired))) {
+            timer->armed = FALSE;
+            timer->func(timer->data);
+        }
+    }
+}
+
+/* Earliest deadline in the wheel, FALSE if no timer is set. Slots are
+ * searched from the current one on, the first one in use on each level
+ * holds that level's earliest timer. */
+static BOOL nextTimer(ULONG *due)
+{
+    struct MinList *slot;
+    struct MinNode *node;
+    struct Timer *timer;
+    BOOL found = FALSE;
+    LONG level;
+    LONG i;
+    
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (i = 1; i <= WHEEL_SIZE; i++) {
+            slot = &bonami.timerSlots[level][((bonami.timerNow >> (WHEEL_BITS * level)) + i) &
+                                              (WHEEL_SIZE - 1)];
+            if (!slot->mlh_Head->mln_Succ) {
+                continue;
+            }
+            for (node = slot->mlh_Head; node->mln_Succ; node = node->mln_Succ) {
+                timer = (struct Timer *)node;
+                if (!found || (LONG)(timer->due - *due) < 0) {
+                    *due = timer->due;
+                    found = TRUE;
+                }
+            }
+            break;
+        }
+    }
+    
+    return found;
+}
+
+/* Sleep until a packet or client message arrives, a signal is raised
+ * or the next timer is due */
+static void waitForWork(void)
+{
+    struct timeval timeout;
+    struct InterfaceState *iface;
+    fd_set readfds;
+    ULONG sigmask;
+    ULONG now;
+    ULONG due;
+    LONG nfds = 0;
+    LONG wait;
+    LONG i;
+    
+    FD_ZERO(&readfds);
+    for (i = 0; i < bonami.num_interfaces; i++) {
+        iface = &bonami.interfaces[i];
+        if (iface->active && iface->online) {
+            FD_SET(iface->socket, &readfds);
+            if (iface->socket >= nfds) {
+                nfds = iface->socket + 1;
+            }
+        }
+    }
+    
+    sigmask = (1UL << bonami.port->mp_SigBit) |
+              SIGBREAKF_CTRL_C | SIGBREAKF_CTRL_D | SIGBREAKF_CTRL_E;
+    
+    /* The interface recheck keeps a timer set at all times */
+    now = getMillis();
+    wait = nextTimer(&due) ? (LONG)(due - now) : INTERFACE_CHECK_INTERVAL * 1000;
+    if (wait <= 0) {
+        return;
+    }
+    timeout.tv_sec = wait / 1000;
+    timeout.tv_usec = (wait % 1000) * 1000;
+    
+    #ifdef __amigaos4__
+    bonami.IRoadshow->WaitSelect(nfds, &readfds, NULL, NULL, &timeout, &sigmask);
+    #else
+    WaitSelect(nfds, &readfds, NULL, NULL, &timeout, &sigmask);
+    #endif
+    
+    /* Signals caught by WaitSelect are raised again for handleSignals */
+    if (sigmask & (SIGBREAKF_CTRL_C | SIGBREAKF_CTRL_D | SIGBREAKF_CTRL_E)) {
+        SetSignal(sigmask, sigmask);
+    }
+}
+
 /* Allocate from pool */
 static APTR AllocPooled(ULONG size)
 {
@@ -2306,6 +3780,7 @@ static LONG initMulticast(struct InterfaceState *iface)
     LONG result;
     int reuse;
     int ttl;
+    LONG nonblock;
     
     /* Create socket */
     iface->socket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -2353,9 +3828,17 @@ static LONG initMulticast(struct InterfaceState *iface)
         return BA_NETWORK;
     }
     
-    /* Set multicast interface */
-    if (setsockopt(iface->socket, IPPROTO_IP, IP_MULTICAST_IF, &iface->addr, sizeof(iface->addr)) < 0) {
-        logMessage(LOG_ERROR, "Failed to set multicast interface: %s", strerror(errno));
+    /* Set multicast interface */
+    if (setsockopt(iface->socket, IPPROTO_IP, IP_MULTICAST_IF, &iface->addr, sizeof(iface->addr)) < 0) {
+        logMessage(LOG_ERROR, "Failed to set multicast interface: %s", strerror(errno));
+        close(iface->socket);
+        return BA_NETWORK;
+    }
+    
+    /* Non-blocking, so the main loop can drain all pending datagrams */
+    nonblock = 1;
+    if (IoctlSocket(iface->socket, FIONBIO, (char *)&nonblock) < 0) {
+        logMessage(LOG_ERROR, "Failed to set non-blocking mode: %s", strerror(errno));
         close(iface->socket);
         return BA_NETWORK;
     }
@@ -2376,145 +3859,610 @@ static void cleanupMulticast(struct InterfaceState *iface)
 static void orphanTask(void)
 {
     struct InterfaceState *iface = FindTask(NULL)->tc_UserData;
-    struct DNSMessage msg;
-    struct sockaddr_in addr;
+    static UBYTE buffer[MAX_PACKET_SIZE];
+    static struct DNSMessage msg;
     LONG result;
     
     while (bonami.running) {
         /* Read orphan packet */
-        result = DoPkt(iface->socket, S2_READORPHAN, &msg, sizeof(msg));
-        if (result < 0) {
+        result = DoPkt(iface->socket, S2_READORPHAN, buffer, sizeof(buffer));
+        if (result <= 0 || dnsParseMessage(buffer, result, &msg) != BA_OK) {
             Delay(10);
             continue;
         }
         
         /* Check if it's a multicast packet */
         if (msg.header.id == 0 && /* mDNS uses 0 for ID */
-            msg.header.flags & DNS_FLAG_QUERY &&
+            !(msg.header.flags1 & DNS_FLAG_QR) &&
             msg.header.qdcount > 0) {
             
-            /* Process DNS message */
-            processDNSMessage(iface, &msg);
+            /* Process DNS message, the sender is not known here */
+            processDNSMessage(iface, &msg, NULL);
         }
         
         Delay(10);
     }
 }
 
-/* Process DNS message */
-static void processDNSMessage(struct InterfaceState *iface, struct DNSMessage *msg)
+/* Drain pending datagrams from an interface */
+static void processDNSMessages(struct InterfaceState *iface)
+{
+    static UBYTE buffer[MAX_PACKET_SIZE];
+    static struct DNSMessage msg;
+    struct sockaddr_in from;
+    LONG len;
+    
+    for (;;) {
+        len = receiveDNSMessage(iface, buffer, sizeof(buffer), &msg, &from);
+        if (len == BA_NOTREADY || len == BA_NETWORK) {
+            break;
+        }
+        
+        /* Malformed packets are dropped */
+        if (len > 0) {
+            processDNSMessage(iface, &msg, &from);
+        }
+    }
+}
+
+/* Process DNS message, from is the sender or NULL if unknown */
+static void processDNSMessage(struct InterfaceState *iface, struct DNSMessage *msg,
+                              const struct sockaddr_in *from)
 {
-    struct DNSQuestion *question;
-    struct DNSRecord *record;
+    char name[BA_MAX_NAME_LEN];
+    struct DNSQuestion question;
+    struct DNSEntry *entry;
+    struct Response response;  /* Multicast answers */
+    struct Response direct;    /* Unicast answers */
+    BOOL legacy;
     LONG i;
     
-    /* Validate message */
-    if (validateDNSMessage(msg) != BA_OK) {
-        return;
+    question.qname = name;
+    initResponse(&response);
+    initResponse(&direct);
+    
+    /* Queries not from port 5353 come from one-shot resolvers that only
+     * accept a unicast reply (RFC 6762 6.7) */
+    legacy = from && from->sin_port != htons(MDNS_PORT);
+    if (from) {
+        direct.direct = TRUE;
+        direct.to = *from;
+        direct.legacy = legacy;
+        direct.query = legacy ? msg : NULL;
     }
     
-    /* Process questions */
-    for (i = 0; i < msg->header.qdcount; i++) {
-        question = &msg->questions[i];
+    /* Walk the parsed view, names are the only thing decoded */
+    for (i = 0; i < msg->numEntries; i++) {
+        entry = &msg->entries[i];
         
         /* Check if it's a .local domain */
-        if (strstr(question->name, ".local")) {
-            /* Process question */
-            processQuestion(iface, question);
+        if (dnsEntryName(msg, entry, name, sizeof(name)) < 0 ||
+            !dnsNameHasSuffix(name, "local")) {
+            continue;
+        }
+        
+        if (entry->section == DNS_SECTION_QUESTION) {
+            /* Questions in responses are ignored (RFC 6762 6) */
+            if (msg->header.flags1 & DNS_FLAG_QR) {
+                continue;
+            }
+            
+            /* A probe for a name we are probing as well */
+            if (entry->type == DNS_TYPE_ANY) {
+                checkProbeTiebreak(iface, msg, name);
+            }
+            
+            /* Collect answers, they are sent once all questions are seen */
+            question.qtype = entry->type;
+            question.qclass = entry->class;
+            if (legacy) {
+                processQuestion(iface, &question, &direct, NULL);
+            } else {
+                processQuestion(iface, &question, &response, from ? &direct : NULL);
+            }
+        } else {
+            /* Another host answering for a name we probe wins it (RFC 6762 8.1) */
+            if (msg->header.flags1 & DNS_FLAG_QR) {
+                checkProbeConflict(iface, name);
+            } else if (entry->section == DNS_SECTION_AUTHORITY) {
+                /* Records a prober proposes are not answers to cache */
+                continue;
+            }
+            
+            /* Process record, RDATA is decoded from the packet buffer */
+            processRecord(iface, msg, entry, name);
         }
     }
     
-    /* Process answers */
-    for (i = 0; i < msg->header.ancount; i++) {
-        record = &msg->answers[i];
+    if (msg->header.flags1 & DNS_FLAG_QR) {
+        /* Another responder sent what we were about to (RFC 6762 7.4) */
+        suppressAnswers(msg, &iface->pending, FALSE);
+    } else {
+        /* Leave out what the querier already knows, then answer once */
+        suppressAnswers(msg, &response, TRUE);
+        suppressAnswers(msg, &direct, TRUE);
+        queueResponse(iface, &response);
         
-        /* Check if it's a .local domain */
-        if (strstr(record->name, ".local")) {
-            /* Process record */
-            processRecord(iface, record);
+        /* Unicast replies concern only the querier and are not delayed */
+        addAdditionals(iface, &direct);
+        sendResponse(iface, &direct);
+    }
+}
+
+/* Start an empty response to the mDNS group */
+static void initResponse(struct Response *response)
+{
+    response->numAnswers = 0;
+    response->numAdditionals = 0;
+    response->numNegatives = 0;
+    response->numNsecNames = 0;
+    response->direct = FALSE;
+    response->legacy = FALSE;
+    response->query = NULL;
+}
+
+/* Send the answers unique to us now and merge the shared ones into the
+ * interface's pending response (RFC 6762 6). NSEC answers only deny
+ * types of unique names, so they go out now as well and the pending
+ * response never holds on to a name atom. */
+static void queueResponse(struct InterfaceState *iface, struct Response *response)
+{
+    UWORD count = 0;
+    UWORD i;
+    
+    for (i = 0; i < response->numAnswers; i++) {
+        if (response->answers[i]->unique) {
+            response->answers[count++] = response->answers[i];
+            continue;
+        }
+        
+        /* The first answer held sets the time, later queries ride along */
+        if (!iface->pendingTimer.armed) {
+            setTimer(&iface->pendingTimer,
+                     getMillis() + randomRange(RESPONSE_DELAY_MIN, RESPONSE_DELAY_MAX));
+        }
+        addAnswer(iface, &iface->pending, response->answers[i]);
+    }
+    response->numAnswers = count;
+    
+    addAdditionals(iface, response);
+    sendResponse(iface, response);
+}
+
+/* Send the pending response once its delay is over */
+static void processPendingResponse(APTR data)
+{
+    struct InterfaceState *iface = data;
+    
+    if (iface->pending.numAnswers == 0) {
+        return;
+    }
+    
+    addAdditionals(iface, &iface->pending);
+    sendResponse(iface, &iface->pending);
+}
+
+/* Take a record out of a response, keeping the rest in order */
+static void forgetAnswer(struct Response *response, struct RecordNode *record)
+{
+    UWORD i;
+    
+    for (i = 0; i < response->numAnswers; i++) {
+        if (response->answers[i] == record) {
+            response->numAnswers--;
+            memmove(&response->answers[i], &response->answers[i + 1],
+                    (response->numAnswers - i) * sizeof(response->answers[0]));
+            return;
+        }
+    }
+}
+
+/* Records that save the querier a round trip (RFC 6763 12): SRV and TXT
+ * for PTR answers, the host address for SRV answers */
+static void addAdditionals(struct InterfaceState *iface, struct Response *response)
+{
+    struct RecordNode *record;
+    UWORD i;
+    
+    for (i = 0; i < response->numAnswers; i++) {
+        record = response->answers[i];
+        if (record->record.type == DNS_TYPE_PTR) {
+            addRelated(iface, response, record->targetAtom, DNS_TYPE_SRV);
+            addRelated(iface, response, record->targetAtom, DNS_TYPE_TXT);
+        } else if (record->record.type == DNS_TYPE_SRV) {
+            addRelated(iface, response, record->targetAtom, DNS_TYPE_A);
+        }
+    }
+    
+    /* SRV records added above need their address as well */
+    for (i = 0; i < response->numAdditionals; i++) {
+        record = response->additionals[i];
+        if (record->record.type == DNS_TYPE_SRV) {
+            addRelated(iface, response, record->targetAtom, DNS_TYPE_A);
+        }
+    }
+    
+    /* Every unique name in the response says which types it lacks, so
+     * the querier does not ask for AAAA and the like (RFC 6762 6.1) */
+    for (i = 0; i < response->numAnswers + response->numAdditionals; i++) {
+        record = i < response->numAnswers ? response->answers[i] :
+                 response->additionals[i - response->numAnswers];
+        if (record->unique) {
+            addName(response->nsecNames, &response->numNsecNames, MAX_ADDITIONAL,
+                    record->nameAtom);
+        }
+    }
+}
+
+/* Add a name atom to a list once */
+static void addName(UWORD *names, UWORD *count, UWORD max, UWORD atom)
+{
+    UWORD i;
+    
+    for (i = 0; i < *count; i++) {
+        if (names[i] == atom) {
+            return;
         }
     }
+    if (*count < max) {
+        names[(*count)++] = atom;
+    }
+}
+
+/* Types of our records of a name on an interface, and their TTL.
+ * Returns the number of types, 0 if the name is not ours there or is
+ * shared (has PTR records), which NSEC must not deny. */
+static LONG ownedTypes(struct InterfaceState *iface, UWORD atom, UWORD *types, ULONG *ttl)
+{
+    struct RecordNode *record;
+    LONG count = 0;
+    LONG i;
     
-    /* Process authority */
-    for (i = 0; i < msg->header.nscount; i++) {
-        record = &msg->authority[i];
+    for (record = bonami.recordHash[RECORD_HASH(atom)]; record; record = record->hashNext) {
+        if (record->nameAtom != atom || !(record->ifaces & IFACE_BIT(iface))) {
+            continue;
+        }
+        if (record->record.type == DNS_TYPE_PTR) {
+            return 0;
+        }
         
-        /* Check if it's a .local domain */
-        if (strstr(record->name, ".local")) {
-            /* Process record */
-            processRecord(iface, record);
+        for (i = 0; i < count && types[i] != record->record.type; i++);
+        if (i == count && count < MAX_NSEC_TYPES) {
+            types[count++] = record->record.type;
         }
+        *ttl = record->record.ttl;
+    }
+    
+    return count;
+}
+
+/* Write the NSEC of one of our names, additional ones only if they fit */
+static void writeNSEC(struct InterfaceState *iface, struct DNSPacketWriter *writer,
+                      UBYTE section, UWORD atom)
+{
+    UBYTE wire[BA_MAX_NAME_LEN * 2 + 48];
+    UWORD types[MAX_NSEC_TYPES];
+    ULONG ttl = 0;
+    LONG count;
+    LONG length;
+    
+    count = ownedTypes(iface, atom, types, &ttl);
+    if (count == 0) {
+        return;
+    }
+    
+    length = dnsBuildNSEC(wire, sizeof(wire), atomName(atom), DNS_CLASS_IN, ttl,
+                          types, count);
+    if (length < 0 || (section == DNS_SECTION_ADDITIONAL && length > dnsWriterRoom(writer))) {
+        return;
     }
     
-    /* Process additional */
-    for (i = 0; i < msg->header.arcount; i++) {
-        record = &msg->additional[i];
+    dnsWriterAddWire(writer, section, wire, length);
+}
+
+/* Add our records of a name and type to the additional section, unless
+ * the response already carries them */
+static void addRelated(struct InterfaceState *iface, struct Response *response,
+                       UWORD atom, UWORD type)
+{
+    struct RecordNode *record;
+    UWORD i;
+    
+    for (record = atom ? bonami.recordHash[RECORD_HASH(atom)] : NULL;
+         record;
+         record = record->hashNext) {
+        if (record->nameAtom != atom || record->record.type != type ||
+            !(record->ifaces & IFACE_BIT(iface))) {
+            continue;
+        }
         
-        /* Check if it's a .local domain */
-        if (strstr(record->name, ".local")) {
-            /* Process record */
-            processRecord(iface, record);
+        for (i = 0; i < response->numAnswers && response->answers[i] != record; i++);
+        if (i < response->numAnswers) {
+            continue;
+        }
+        for (i = 0; i < response->numAdditionals && response->additionals[i] != record; i++);
+        if (i < response->numAdditionals || response->numAdditionals >= MAX_ADDITIONAL) {
+            continue;
         }
+        
+        response->additionals[response->numAdditionals++] = record;
     }
 }
 
-/* Process DNS question */
-static void processQuestion(struct InterfaceState *iface, struct DNSQuestion *question)
+/* Drop answers that records in msg make redundant. For known-answer
+ * suppression (RFC 6762 7.1) the query's answer section is checked and
+ * half our TTL is enough; for duplicate-answer suppression (7.4) any
+ * record of a response counts if its TTL is at least ours. */
+static void suppressAnswers(struct DNSMessage *msg, struct Response *response, BOOL known)
 {
-    struct DNSRecord *record;
-    struct DNSMessage response;
-    struct sockaddr_in addr;
-    LONG result;
+    char name[BA_MAX_NAME_LEN];
+    struct DNSEntry *entry;
+    struct RecordNode *record;
+    ULONG ttl;
+    UWORD atom;
+    UWORD i;
+    LONG k;
+    
+    for (k = 0; k < msg->numEntries && response->numAnswers > 0; k++) {
+        entry = &msg->entries[k];
+        if (entry->section == DNS_SECTION_QUESTION ||
+            (known && entry->section != DNS_SECTION_ANSWER) ||
+            dnsEntryName(msg, entry, name, sizeof(name)) < 0) {
+            continue;
+        }
+        
+        atom = findName(name);
+        if (!atom) {
+            continue;
+        }
+        
+        for (i = 0; i < response->numAnswers; i++) {
+            record = response->answers[i];
+            ttl = known ? record->record.ttl / 2 : record->record.ttl;
+            if (record->nameAtom == atom &&
+                record->record.type == entry->type &&
+                (record->record.class & DNS_CLASS_MASK) == (entry->class & DNS_CLASS_MASK) &&
+                entry->ttl >= ttl &&
+                dnsEntryRDataEqual(msg, entry, record->record.rdata,
+                                   record->record.rdlength)) {
+                forgetAnswer(response, record);
+                break;
+            }
+        }
+    }
+}
+
+/* Process DNS question, matching records are added to the response.
+ * A QU question (RFC 6762 5.4) gets its answers in direct instead, as
+ * long as the record went to the group within a quarter of its TTL. */
+static void processQuestion(struct InterfaceState *iface, struct DNSQuestion *question,
+                            struct Response *response, struct Response *direct)
+{
+    struct RecordNode *record;
+    struct Response *negative;
+    UWORD qclass = question->qclass & DNS_CLASS_MASK;
+    BOOL unicast = direct && (question->qclass & ~DNS_CLASS_MASK);
+    BOOL found = FALSE;
+    ULONG now = getMillis();
+    ULONG bit = IFACE_BIT(iface);
+    UWORD types[MAX_NSEC_TYPES];
+    ULONG ttl;
+    UWORD atom;
+    
+    /* A name we never interned is not one of ours */
+    atom = findName(question->qname);
+    if (!atom) {
+        return;
+    }
     
-    /* Check if we have a matching record */
-    for (record = (struct DNSRecord *)iface->records.lh_Head;
-         record->node.ln_Succ;
-         record = (struct DNSRecord *)record->node.ln_Succ) {
-        if (strcmp(record->name, question->name) == 0 &&
-            record->type == question->type &&
-            record->class == question->class) {
-            
-            /* Create response */
-            memset(&response, 0, sizeof(response));
-            response.header.id = 0;
-            response.header.flags = DNS_FLAG_RESPONSE;
-            response.header.ancount = 1;
-            
-            /* Copy record */
-            memcpy(&response.answers[0], record, sizeof(struct DNSRecord));
-            
-            /* Send response */
-            memset(&addr, 0, sizeof(addr));
-            addr.sin_family = AF_INET;
-            addr.sin_addr.s_addr = inet_addr(MDNS_MULTICAST_ADDR);
-            addr.sin_port = htons(MDNS_PORT);
-            
-            result = sendto(iface->socket, &response, sizeof(response), 0,
-                          (struct sockaddr *)&addr, sizeof(addr));
-            if (result < 0) {
-                logMessage(LOG_ERROR, "Failed to send response: %s", strerror(errno));
+    /* Every matching record on this interface, ANY matches all types and classes */
+    for (record = bonami.recordHash[RECORD_HASH(atom)]; record; record = record->hashNext) {
+        if (record->nameAtom == atom && (record->ifaces & bit) &&
+            (question->qtype == DNS_TYPE_ANY || record->record.type == question->qtype) &&
+            (qclass == DNS_CLASS_ANY ||
+             (record->record.class & DNS_CLASS_MASK) == qclass)) {
+            if (unicast && record->lastMulticast &&
+                now - record->lastMulticast < record->record.ttl * 250) {
+                addAnswer(iface, direct, record);
+            } else {
+                addAnswer(iface, response, record);
             }
-            
-            break;
+            found = TRUE;
         }
     }
+    
+    /* A name of ours without the type asked for gets an NSEC instead of
+     * silence, so the querier stops retrying */
+    if (!found && question->qtype != DNS_TYPE_ANY &&
+        (qclass == DNS_CLASS_IN || qclass == DNS_CLASS_ANY) &&
+        ownedTypes(iface, atom, types, &ttl) > 0) {
+        negative = unicast ? direct : response;
+        addName(negative->negatives, &negative->numNegatives, MAX_NEGATIVES, atom);
+    }
+}
+
+/* Add a record to a response once, sending the response early if full */
+static void addAnswer(struct InterfaceState *iface, struct Response *response,
+                      struct RecordNode *record)
+{
+    UWORD i;
+    
+    /* Several questions can match the same record */
+    for (i = 0; i < response->numAnswers; i++) {
+        if (response->answers[i] == record) {
+            return;
+        }
+    }
+    
+    if (response->numAnswers >= MAX_ANSWERS) {
+        /* Sending held answers early would skip their delay and the
+         * suppression of answers other hosts give first (RFC 6762 7.4).
+         * A full pending response leaves the record out instead; the
+         * querier asks again. */
+        if (response == &iface->pending) {
+            logMessage(LOG_DEBUG, "Pending response full, %s left out",
+                       record->record.name);
+            return;
+        }
+        sendResponse(iface, response);
+    }
+    
+    response->answers[response->numAnswers++] = record;
+}
+
+/* Send the collected answers, split only where they exceed the budget.
+ * Legacy replies echo the query ID and questions and cap TTLs
+ * (RFC 6762 6.7). */
+static void sendResponse(struct InterfaceState *iface, struct Response *response)
+{
+    struct DNSPacketWriter writer;
+    struct PacketTarget target;
+    struct RecordNode *record;
+    struct DNSQuestion question;
+    struct DNSEntry *entry;
+    UBYTE buffer[DNS_DEFAULT_BUDGET];
+    char name[BA_MAX_NAME_LEN];
+    ULONG now = getMillis();
+    UWORD i, k;
+    
+    if (response->numAnswers == 0 && response->numNegatives == 0) {
+        return;
+    }
+    
+    target.iface = iface;
+    target.to = response->direct ? &response->to : NULL;
+    dnsWriterInit(&writer, buffer, sizeof(buffer), DNS_FLAG_QR | DNS_FLAG_AA,
+                  sendPacketTo, &target);
+    
+    if (response->legacy && response->query) {
+        writer.header.id = response->query->header.id;
+        writer.maxTTL = LEGACY_TTL;
+        question.qname = name;
+        for (i = 0; i < response->query->numEntries; i++) {
+            entry = &response->query->entries[i];
+            if (entry->section == DNS_SECTION_QUESTION &&
+                dnsEntryName(response->query, entry, name, sizeof(name)) >= 0) {
+                question.qtype = entry->type;
+                question.qclass = entry->class & DNS_CLASS_MASK;
+                dnsWriterAddQuestion(&writer, &question);
+            }
+        }
+    }
+    
+    for (i = 0; i < response->numAnswers; i++) {
+        record = response->answers[i];
+        if (dnsWriterAddWire(&writer, DNS_SECTION_ANSWER, record->wire,
+                             record->wireLength) < 0) {
+            logMessage(LOG_ERROR, "Failed to encode response for %s", record->record.name);
+        } else if (!response->direct) {
+            record->lastMulticast = now;
+        }
+    }
+    for (i = 0; i < response->numNegatives; i++) {
+        writeNSEC(iface, &writer, DNS_SECTION_ANSWER, response->negatives[i]);
+    }
+    
+    /* Additional records are a hint, they never cost another packet */
+    for (i = 0; i < response->numAdditionals; i++) {
+        record = response->additionals[i];
+        if (record->wireLength <= dnsWriterRoom(&writer) &&
+            dnsWriterAddWire(&writer, DNS_SECTION_ADDITIONAL, record->wire,
+                             record->wireLength) >= 0 &&
+            !response->direct) {
+            record->lastMulticast = now;
+        }
+    }
+    for (i = 0; i < response->numNsecNames; i++) {
+        for (k = 0; k < response->numNegatives &&
+             response->negatives[k] != response->nsecNames[i]; k++);
+        if (k == response->numNegatives) {
+            writeNSEC(iface, &writer, DNS_SECTION_ADDITIONAL, response->nsecNames[i]);
+        }
+    }
+    
+    dnsWriterFlush(&writer);
+    response->numAnswers = 0;
+    response->numAdditionals = 0;
+    response->numNegatives = 0;
+    response->numNsecNames = 0;
 }
 
 /* Process DNS record */
-static void processRecord(struct InterfaceState *iface, struct DNSRecord *record)
+static void processRecord(struct InterfaceState *iface, struct DNSMessage *msg,
+                          const struct DNSEntry *rr, const char *name)
 {
-    struct CacheEntry *entry;
+    struct CacheEntry *entry = NULL;
+    struct DNSRDataIter iter;
+    struct DNSRData rd;
+    char target[BA_MAX_NAME_LEN];
+    UWORD atom;
+    UWORD targetAtom = 0;
+    LONG result;
+    
+    /* Decode only the fields the cache keeps */
+    if (dnsEntryRData(msg, rr, &iter) < 0) {
+        return;
+    }
+    result = dnsRDataNext(&iter, &rd);
+    
+    switch (rr->type) {
+        case DNS_TYPE_A:
+        case DNS_TYPE_AAAA:
+            if (result != 1) {
+                return;
+            }
+            break;
+            
+        case DNS_TYPE_PTR:
+        case DNS_TYPE_SRV:
+            if (result != 1 ||
+                dnsReadName(msg->data, msg->length, rd.name, target, sizeof(target),
+                            &msg->names) < 0) {
+                return;
+            }
+            targetAtom = findName(target);
+            break;
+            
+        case DNS_TYPE_TXT:
+            /* Every string must fit before the RDATA is kept */
+            while (result > 0) {
+                result = dnsRDataNext(&iter, &rd);
+            }
+            if (result < 0) {
+                return;
+            }
+            break;
+            
+        default:
+            return;
+    }
     
     /* Check if we already have this record */
-    entry = findCacheEntry(record->name, record->type, record->class);
+    atom = findName(name);
+    if (atom) {
+        entry = findCacheEntry(atom, rr->type, rr->class, targetAtom);
+    }
     if (entry) {
         /* Update existing entry */
-        memcpy(entry->data, record, sizeof(struct DNSRecord));
-        entry->ttl = record->ttl;
-        entry->expires = GetSysTime() + record->ttl;
+        entry->ttl = rr->ttl;
+        setCacheExpiry(entry);
     } else {
         /* Add new entry */
-        addCacheEntry(record->name, record->type, record->class, record, record->ttl);
+        entry = addCacheEntry(name, rr->type, rr->class, rr->ttl);
+        if (!entry) {
+            return;
+        }
+    }
+    
+    if (storeCacheData(entry, &rd, target, msg->data + rr->rdoffset, rr->rdlength) != BA_OK) {
+        Remove((struct Node *)entry);
+        freeCacheEntry(entry);
+        return;
+    }
+    
+    /* Update hosts file if needed */
+    if (bonami.updateHosts && rr->type == DNS_TYPE_A && dnsNameHasSuffix(name, "local")) {
+        updateHostsFile();
     }
 }
 
@@ -2545,10 +4493,10 @@ static LONG updateHostsFile(void)
     for (entry = (struct CacheEntry *)bonami.cache.lh_Head;
          entry->node.ln_Succ;
          entry = (struct CacheEntry *)entry->node.ln_Succ) {
-        if (entry->type == DNS_TYPE_A && strstr(entry->name, ".local")) {
+        if (entry->type == DNS_TYPE_A && dnsNameHasSuffix(atomName(entry->nameAtom), "local")) {
             struct in_addr addr;
-            memcpy(&addr, &entry->data->data.a.addr, sizeof(struct in_addr));
-            sprintf(buffer, "%s\t%s\n", inet_ntoa(addr), entry->name);
+            memcpy(&addr, entry->addr, sizeof(struct in_addr));
+            sprintf(buffer, "%s\t%s\n", inet_ntoa(addr), atomName(entry->nameAtom));
             Write(file, buffer, strlen(buffer));
         }
     }
@@ -2558,135 +4506,52 @@ static LONG updateHostsFile(void)
     return BA_OK;
 }
 
-/* DNS message header */
-struct DNSHeader {
-    WORD id;
-    WORD flags;
-    WORD qdcount;
-    WORD ancount;
-    WORD nscount;
-    WORD arcount;
-};
-
-/* DNS message */
-struct DNSMessage {
-    struct DNSHeader header;
-    struct DNSQuestion questions[MAX_QUESTIONS];
-    struct DNSRecord answers[MAX_ANSWERS];
-    struct DNSRecord authority[MAX_AUTHORITY];
-    struct DNSRecord additional[MAX_ADDITIONAL];
-};
-
-/* Validate DNS message */
-static LONG validateDNSMessage(struct DNSMessage *msg)
+/* Packet writer callback, sends a finished packet on the interface */
+static LONG sendPacket(const UBYTE *data, LONG len, APTR userData)
 {
-    /* Check header */
-    if (msg->header.qdcount > MAX_QUESTIONS ||
-        msg->header.ancount > MAX_ANSWERS ||
-        msg->header.nscount > MAX_AUTHORITY ||
-        msg->header.arcount > MAX_ADDITIONAL) {
-        return BA_BADPARAM;
-    }
-    
-    /* Check questions */
-    for (LONG i = 0; i < msg->header.qdcount; i++) {
-        if (!msg->questions[i].name[0] ||
-            strlen(msg->questions[i].name) > 255) {
-            return BA_BADPARAM;
-        }
-    }
-    
-    /* Check answers */
-    for (LONG i = 0; i < msg->header.ancount; i++) {
-        if (!msg->answers[i].name[0] ||
-            strlen(msg->answers[i].name) > 255 ||
-            msg->answers[i].rdlength > 65535) {
-            return BA_BADPARAM;
-        }
-    }
-    
-    /* Check authority */
-    for (LONG i = 0; i < msg->header.nscount; i++) {
-        if (!msg->authority[i].name[0] ||
-            strlen(msg->authority[i].name) > 255 ||
-            msg->authority[i].rdlength > 65535) {
-            return BA_BADPARAM;
-        }
-    }
-    
-    /* Check additional */
-    for (LONG i = 0; i < msg->header.arcount; i++) {
-        if (!msg->additional[i].name[0] ||
-            strlen(msg->additional[i].name) > 255 ||
-            msg->additional[i].rdlength > 65535) {
-            return BA_BADPARAM;
-        }
-    }
-    
-    return BA_OK;
+    return sendDNSMessage((struct InterfaceState *)userData, data, len, NULL);
 }
 
-/* Build DNS message */
-static LONG buildDNSMessage(struct DNSMessage *msg, struct DNSQuestion *question)
+/* Packet writer callback, userData is a struct PacketTarget */
+static LONG sendPacketTo(const UBYTE *data, LONG len, APTR userData)
 {
-    /* Initialize message */
-    memset(msg, 0, sizeof(struct DNSMessage));
-    
-    /* Set header */
-    msg->header.id = 0;  /* mDNS uses 0 for ID */
-    msg->header.flags = DNS_FLAG_QUERY;
-    msg->header.qdcount = 1;
+    struct PacketTarget *target = userData;
     
-    /* Copy question */
-    strncpy(msg->questions[0].name, question->name, sizeof(msg->questions[0].name) - 1);
-    msg->questions[0].type = question->type;
-    msg->questions[0].class = question->class;
-    
-    return BA_OK;
+    return sendDNSMessage(target->iface, data, len, target->to);
 }
 
-/* Build DNS response */
-static LONG buildDNSResponse(struct DNSMessage *msg, struct DNSRecord *record)
+/* Packet writer callback, userData is a struct AnnounceTarget */
+static LONG sendAnnouncement(const UBYTE *data, LONG len, APTR userData)
 {
-    /* Initialize message */
-    memset(msg, 0, sizeof(struct DNSMessage));
+    struct AnnounceTarget *target = userData;
+    LONG result = sendDNSMessage(target->iface, data, len, NULL);
     
-    /* Set header */
-    msg->header.id = 0;  /* mDNS uses 0 for ID */
-    msg->header.flags = DNS_FLAG_RESPONSE;
-    msg->header.ancount = 1;
-    
-    /* Copy record */
-    strncpy(msg->answers[0].name, record->name, sizeof(msg->answers[0].name) - 1);
-    msg->answers[0].type = record->type;
-    msg->answers[0].class = record->class;
-    msg->answers[0].ttl = record->ttl;
-    msg->answers[0].rdlength = record->rdlength;
-    memcpy(msg->answers[0].rdata, record->rdata, record->rdlength);
-    
-    return BA_OK;
+    if (result != BA_OK) {
+        target->failed |= PACKET_BIT(target->packets);
+    }
+    target->packets++;
+    return result;
 }
 
-/* Send DNS message */
-static LONG sendDNSMessage(struct InterfaceState *iface, struct DNSMessage *msg)
+/* Send DNS message to the mDNS group, or to one host if to is set */
+static LONG sendDNSMessage(struct InterfaceState *iface, const UBYTE *data, LONG len,
+                           const struct sockaddr_in *to)
 {
     struct sockaddr_in addr;
     LONG result;
     
-    /* Validate message */
-    result = validateDNSMessage(msg);
-    if (result != BA_OK) {
-        return result;
-    }
-    
     /* Initialize address */
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(MDNS_MULTICAST_ADDR);
-    addr.sin_port = htons(MDNS_PORT);
+    if (to) {
+        addr = *to;
+    } else {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr(MDNS_MULTICAST_ADDR);
+        addr.sin_port = htons(MDNS_PORT);
+    }
     
-    /* Send message */
-    result = sendto(iface->socket, msg, sizeof(struct DNSMessage), 0,
+    /* Send exactly the encoded bytes */
+    result = sendto(iface->socket, (APTR)data, len, 0,
                    (struct sockaddr *)&addr, sizeof(addr));
     if (result < 0) {
         logMessage(LOG_ERROR, "Failed to send DNS message: %s", strerror(errno));
@@ -2696,28 +4561,30 @@ static LONG sendDNSMessage(struct InterfaceState *iface, struct DNSMessage *msg)
     return BA_OK;
 }
 
-/* Receive DNS message */
-static LONG receiveDNSMessage(struct InterfaceState *iface, struct DNSMessage *msg)
+/* Receive DNS message, returns the datagram length and its sender */
+static LONG receiveDNSMessage(struct InterfaceState *iface, UBYTE *buffer, LONG buflen,
+                              struct DNSMessage *msg, struct sockaddr_in *from)
 {
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
+    socklen_t addrlen = sizeof(*from);
     LONG result;
     
     /* Receive message */
-    result = recvfrom(iface->socket, msg, sizeof(struct DNSMessage), 0,
-                     (struct sockaddr *)&addr, &addrlen);
+    result = recvfrom(iface->socket, buffer, buflen, 0,
+                     (struct sockaddr *)from, &addrlen);
     if (result < 0) {
+        if (errno == EWOULDBLOCK) {
+            return BA_NOTREADY;
+        }
         logMessage(LOG_ERROR, "Failed to receive DNS message: %s", strerror(errno));
         return BA_NETWORK;
     }
     
-    /* Validate message */
-    result = validateDNSMessage(msg);
-    if (result != BA_OK) {
-        return result;
+    /* Parse and validate message */
+    if (dnsParseMessage(buffer, result, msg) != BA_OK) {
+        return BA_BADPARAM;
     }
     
-    return BA_OK;
+    return result;
 }
 
 /* Check if interface is online */
@@ -2798,10 +4665,9 @@ static void checkInterfaces(void)
         }
     }
     
-    /* If no interfaces are online, sleep */
+    /* The recheck timer tries again later */
     if (!anyOnline) {
-        logMessage(LOG_INFO, "No interfaces online, sleeping...");
-        Delay(INTERFACE_CHECK_INTERVAL * 50); /* Convert seconds to ticks */
+        logMessage(LOG_INFO, "No interfaces online, waiting...");
     }
 }
 
@@ -2819,31 +4685,24 @@ static void mainTask(void)
         return;
     }
     
+    /* Interfaces are checked again from the timer wheel */
+    recheckInterfaces(NULL);
+    
     /* Main loop */
     while (running) {
-        /* Check interfaces */
-        checkInterfaces();
-        
-        /* Process each active interface */
+        /* Process DNS messages on each active interface */
         for (i = 0; i < bonami.num_interfaces; i++) {
             iface = &bonami.interfaces[i];
-            
-            if (!iface->active || !iface->online) {
-                continue;
+            if (iface->active && iface->online) {
+                processDNSMessages(iface);
             }
-            
-            /* Process probes */
-            processProbes(iface);
-            
-            /* Process announcements */
-            processAnnouncements(iface);
-            
-            /* Process DNS messages */
-            processDNSMessages(iface);
         }
         
-        /* Small delay to prevent CPU hogging */
-        Delay(1);
+        /* Probes, announcements, delayed responses, queries, cache expiry */
+        runTimers(getMillis());
+        
+        /* Sleep until there is something to do */
+        waitForWork();
     }
     
     /* Cleanup */
@@ -3058,6 +4917,9 @@ static LONG checkInterfaceState(struct InterfaceState *iface)
                 iface->addr = currentAddr;
                 iface->linkLocal = isLinkLocal(currentAddr);
                 
+                /* Only the A record differs between interfaces */
+                addHostRecord(iface);
+                
                 if (initMulticast(iface) == BA_OK) {
                     iface->active = TRUE;
                     
@@ -35,6 +35,7 @@
 #define MSG_MONITOR    7
 #define MSG_CONFIG     8
 #define MSG_ENUMERATE  9
+#define MSG_REGISTER_BATCH 10
 
 /* Message structure for daemon communication */
 struct BAMessage {
@@ -43,6 +44,8 @@ struct BAMessage {
     union {
         struct {
             struct BAService *service;
+            BARegisterCallback callback;  /* Outcome once probing ends, or NULL */
+            APTR userData;
             LONG result;
         } register_msg;
         struct {
@@ -83,6 +86,10 @@ struct BAMessage {
             struct List *types;
             LONG result;
         } enumerate_msg;
+        struct {
+            struct BABatch *batch;
+            LONG result;
+        } batch_msg;
     } data;
 };
 
@@ -335,6 +342,99 @@ LONG BARegisterService(const struct BAService *service)
     return result;
 }
 
+/* Register service and learn the outcome of probing through callback.
+ * BA_OK here only means the service was accepted and is being probed. */
+LONG BARegisterServiceNotify(struct BAService *service, BARegisterCallback callback,
+                             APTR userData)
+{
+    struct BAMessage *msg;
+    LONG result;
+    
+    /* Check if BonAmi is running */
+    result = checkBonAmi();
+    if (result != BA_OK) {
+        return result;
+    }
+    
+    /* Validate parameters */
+    if (!service || !service->name || !service->type || service->port <= 0) {
+        return BA_INVALID;
+    }
+    
+    /* Create message */
+    msg = AllocVec(sizeof(struct BAMessage), MEMF_CLEAR);
+    if (!msg) {
+        return BA_NOMEM;
+    }
+    
+    /* Initialize message */
+    msg->type = MSG_REGISTER;
+    msg->data.register_msg.service = service;
+    msg->data.register_msg.callback = callback;
+    msg->data.register_msg.userData = userData;
+    
+    /* Send message */
+    #ifdef __amigaos4__
+    result = IBonAmi->BASendMessage(msg);
+    #else
+    result = BASendMessage(msg);
+    #endif
+    
+    /* Free message */
+    FreeVec(msg);
+    
+    return result;
+}
+
+/* Register several services in one request. The daemon probes and
+ * announces them together; if one fails none is registered. */
+LONG BARegisterServices(struct BABatch *batch)
+{
+    struct BAMessage *msg;
+    ULONG i;
+    LONG result;
+    
+    /* Check if BonAmi is running */
+    result = checkBonAmi();
+    if (result != BA_OK) {
+        return result;
+    }
+    
+    /* Validate parameters */
+    if (!batch || !batch->services || batch->numServices == 0 ||
+        batch->numServices > batch->maxServices) {
+        return BA_INVALID;
+    }
+    for (i = 0; i < batch->numServices; i++) {
+        if (!batch->services[i].name || !batch->services[i].type ||
+            batch->services[i].port <= 0) {
+            return BA_INVALID;
+        }
+    }
+    
+    /* Create message */
+    msg = AllocVec(sizeof(struct BAMessage), MEMF_CLEAR);
+    if (!msg) {
+        return BA_NOMEM;
+    }
+    
+    /* Initialize message, the daemon reads the services in place */
+    msg->type = MSG_REGISTER_BATCH;
+    msg->data.batch_msg.batch = batch;
+    
+    /* Send message */
+    #ifdef __amigaos4__
+    result = IBonAmi->BASendMessage(msg);
+    #else
+    result = BASendMessage(msg);
+    #endif
+    
+    /* Free message */
+    FreeVec(msg);
+    
+    return result;
+}
+
 /* Unregister service */
 LONG BAUnregisterService(const char *name, const char *type)
 {
@@ -7,107 +7,149 @@
 #include "../include/dns.h"
 #include "../include/bonami.h"
 
-/* Parse a DNS message */
+/* Load a 16-bit value in network byte order */
+static UWORD getWord(const UBYTE *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/* Load a 32-bit value in network byte order */
+static ULONG getLong(const UBYTE *p)
+{
+    return ((ULONG)p[0] << 24) | ((ULONG)p[1] << 16) | ((ULONG)p[2] << 8) | p[3];
+}
+
+/* Parse a DNS message into an offset-indexed view.
+ * Each question and record is located in a single pass over the packet;
+ * msg->entries then holds its name offset, type, class, TTL and RDATA span. */
 LONG dnsParseMessage(const UBYTE *data, LONG len, struct DNSMessage *msg)
 {
     // Basic validation
-    if (!data || !msg || len < sizeof(struct DNSHeader))
+    if (!data || !msg || len < DNS_HEADER_SIZE)
         return BA_BADPARAM;
         
     // Validate message length
     if (len > MAX_PACKET_SIZE)
         return BA_BADPARAM;
         
+    /* Copy header */
+    msg->header.id = getWord(data);
+    msg->header.flags1 = data[2];
+    msg->header.flags2 = data[3];
+    msg->header.qdcount = getWord(data + 4);
+    msg->header.ancount = getWord(data + 6);
+    msg->header.nscount = getWord(data + 8);
+    msg->header.arcount = getWord(data + 10);
+
     // Validate header fields
-    struct DNSHeader *header = (struct DNSHeader *)data;
-    if (ntohs(header->qdcount) > MAX_QUESTIONS ||
-        ntohs(header->ancount) > MAX_ANSWERS ||
-        ntohs(header->nscount) > MAX_AUTHORITY ||
-        ntohs(header->arcount) > MAX_ADDITIONAL)
+    if (msg->header.qdcount > MAX_QUESTIONS ||
+        msg->header.ancount > MAX_ANSWERS ||
+        msg->header.nscount > MAX_AUTHORITY ||
+        msg->header.arcount > MAX_ADDITIONAL)
         return BA_BADPARAM;
         
     // Validate flags
-    if ((header->flags1 & 0x3F) != 0) // Reserved bits must be 0
+    if ((msg->header.flags1 & 0x78) != 0) // OPCODE must be 0 (standard query)
         return BA_BADPARAM;
         
     // Validate response code
-    if ((header->flags2 & 0x0F) > 5) // Valid RCODE values are 0-5
+    if ((msg->header.flags2 & 0x0F) > 5) // Valid RCODE values are 0-5
         return BA_BADPARAM;
 
-    /* Copy header */
-    memcpy(&msg->header, data, sizeof(struct DNSHeader));
-    msg->header.id = ntohs(msg->header.id);
-    msg->header.qdcount = ntohs(msg->header.qdcount);
-    msg->header.ancount = ntohs(msg->header.ancount);
-    msg->header.nscount = ntohs(msg->header.nscount);
-    msg->header.arcount = ntohs(msg->header.arcount);
-
-    /* Set pointers to sections */
-    UBYTE *ptr = (UBYTE *)data + sizeof(struct DNSHeader);
-    
-    /* Questions section */
-    msg->questions = ptr;
-    for (UWORD i = 0; i < msg->header.qdcount; i++) {
-        ptr = dnsSkipName(ptr, len - (ptr - data));
-        if (!ptr) return BA_BADPARAM;
-        if (len - (ptr - data) < 4) return BA_BADPARAM; // Check for type and class
-        ptr += 4; /* Skip type and class */
-    }
+    msg->data = data;
+    msg->length = len;
+    msg->numEntries = 0;
+    dnsInitNameCache(&msg->names);
 
-    /* Answers section */
-    msg->answers = ptr;
-    for (UWORD i = 0; i < msg->header.ancount; i++) {
-        ptr = dnsSkipName(ptr, len - (ptr - data));
-        if (!ptr) return BA_BADPARAM;
-        if (len - (ptr - data) < 10) return BA_BADPARAM; // Check for type, class, TTL, RDATA length
-        UWORD rdlength = ntohs(*(UWORD *)(ptr + 8));
-        if (len - (ptr - data) < 10 + rdlength) return BA_BADPARAM; // Check for RDATA
-        ptr += 10 + rdlength;
-    }
+    /* Section boundaries, in entry numbers */
+    UWORD ends[4];
+    ends[DNS_SECTION_QUESTION] = msg->header.qdcount;
+    ends[DNS_SECTION_ANSWER] = ends[DNS_SECTION_QUESTION] + msg->header.ancount;
+    ends[DNS_SECTION_AUTHORITY] = ends[DNS_SECTION_ANSWER] + msg->header.nscount;
+    ends[DNS_SECTION_ADDITIONAL] = ends[DNS_SECTION_AUTHORITY] + msg->header.arcount;
+
+    const UBYTE *ptr = data + DNS_HEADER_SIZE;
+    const UBYTE *end = data + len;
+    UBYTE section = DNS_SECTION_QUESTION;
+
+    msg->questions = (UBYTE *)ptr;
+    while (msg->numEntries < ends[DNS_SECTION_ADDITIONAL]) {
+        /* Record where each section starts */
+        while (msg->numEntries == ends[section]) {
+            section++;
+            if (section == DNS_SECTION_ANSWER) msg->answers = (UBYTE *)ptr;
+            else if (section == DNS_SECTION_AUTHORITY) msg->authority = (UBYTE *)ptr;
+            else msg->additional = (UBYTE *)ptr;
+        }
 
-    /* Authority section */
-    msg->authority = ptr;
-    for (UWORD i = 0; i < msg->header.nscount; i++) {
-        ptr = dnsSkipName(ptr, len - (ptr - data));
+        struct DNSEntry *entry = &msg->entries[msg->numEntries++];
+        entry->offset = ptr - data;
+        entry->section = section;
+
+        ptr = dnsSkipName(ptr, end - ptr);
         if (!ptr) return BA_BADPARAM;
-        if (len - (ptr - data) < 10) return BA_BADPARAM; // Check for type, class, TTL, RDATA length
-        UWORD rdlength = ntohs(*(UWORD *)(ptr + 8));
-        if (len - (ptr - data) < 10 + rdlength) return BA_BADPARAM; // Check for RDATA
-        ptr += 10 + rdlength;
+
+        if (section == DNS_SECTION_QUESTION) {
+            if (end - ptr < 4) return BA_BADPARAM; // Check for type and class
+            entry->type = getWord(ptr);
+            entry->class = getWord(ptr + 2);
+            entry->ttl = 0;
+            entry->rdoffset = 0;
+            entry->rdlength = 0;
+            ptr += 4;
+            continue;
+        }
+
+        if (end - ptr < 10) return BA_BADPARAM; // Check for type, class, TTL, RDATA length
+        entry->type = getWord(ptr);
+        entry->class = getWord(ptr + 2);
+        entry->ttl = getLong(ptr + 4);
+        entry->rdlength = getWord(ptr + 8);
+        entry->rdoffset = (ptr + 10) - data;
+        if (end - ptr < 10 + entry->rdlength) return BA_BADPARAM; // Check for RDATA
+        ptr += 10 + entry->rdlength;
     }
 
-    /* Additional section */
-    msg->additional = ptr;
-    for (UWORD i = 0; i < msg->header.arcount; i++) {
-        ptr = dnsSkipName(ptr, len - (ptr - data));
-        if (!ptr) return BA_BADPARAM;
-        if (len - (ptr - data) < 10) return BA_BADPARAM; // Check for type, class, TTL, RDATA length
-        UWORD rdlength = ntohs(*(UWORD *)(ptr + 8));
-        if (len - (ptr - data) < 10 + rdlength) return BA_BADPARAM; // Check for RDATA
-        ptr += 10 + rdlength;
+    /* Empty trailing sections start at the end of the data */
+    while (section < DNS_SECTION_ADDITIONAL) {
+        section++;
+        if (section == DNS_SECTION_ANSWER) msg->answers = (UBYTE *)ptr;
+        else if (section == DNS_SECTION_AUTHORITY) msg->authority = (UBYTE *)ptr;
+        else msg->additional = (UBYTE *)ptr;
     }
 
     return BA_OK;
 }
 
-/* Parse a DNS question */
-LONG dnsParseQuestion(const UBYTE *data, LONG len, struct DNSQuestion *q)
+/* Decode the owner name of a parsed entry, sharing suffixes already
+ * decoded from the same packet */
+LONG dnsEntryName(struct DNSMessage *msg, const struct DNSEntry *entry,
+                  char *name, LONG namelen)
+{
+    if (!msg || !entry)
+        return BA_BADPARAM;
+
+    return dnsReadName(msg->data, msg->length, entry->offset, name, namelen, &msg->names);
+}
+
+/* Parse the DNS question at offset within a message */
+LONG dnsParseQuestion(const UBYTE *data, LONG len, LONG offset, struct DNSQuestion *q)
 {
     if (!data || !q)
         return BA_BADPARAM;
 
     /* Parse name */
-    LONG nameLen = dnsLabelsToName(data, len, q->qname, BA_MAX_NAME_LEN);
+    LONG nameLen = dnsReadName(data, len, offset, q->qname, BA_MAX_NAME_LEN, NULL);
     if (nameLen < 0)
         return BA_BADPARAM;
 
     /* Parse type and class */
-    UBYTE *ptr = data + nameLen;
-    if (len - nameLen < 4)
+    const UBYTE *ptr = data + offset + nameLen;
+    if (len - offset - nameLen < 4)
         return BA_BADPARAM;
 
-    q->qtype = ntohs(*(UWORD *)ptr);
-    q->qclass = ntohs(*(UWORD *)(ptr + 2));
+    q->qtype = getWord(ptr);
+    q->qclass = getWord(ptr + 2);
 
     /* Validate type and class */
     if (q->qtype != DNS_TYPE_A && 
@@ -117,32 +159,35 @@ LONG dnsParseQuestion(const UBYTE *data, LONG len, struct DNSQuestion *q)
         q->qtype != DNS_TYPE_ANY)
         return BA_BADPARAM;
 
-    if (q->qclass != DNS_CLASS_IN && q->qclass != DNS_CLASS_ANY)
+    /* The top bit is the mDNS unicast-response (QU) flag */
+    if ((q->qclass & DNS_CLASS_MASK) != DNS_CLASS_IN &&
+        (q->qclass & DNS_CLASS_MASK) != DNS_CLASS_ANY)
         return BA_BADPARAM;
 
     return nameLen + 4;
 }
 
-/* Parse a DNS record */
-LONG dnsParseRecord(const UBYTE *data, LONG len, struct DNSRecord *r)
+/* Parse the DNS record at offset within a message */
+LONG dnsParseRecord(const UBYTE *data, LONG len, LONG offset, struct DNSRecord *r)
 {
     if (!data || !r)
         return BA_BADPARAM;
 
     /* Parse name */
-    LONG nameLen = dnsLabelsToName(data, len, r->name, BA_MAX_NAME_LEN);
+    LONG nameLen = dnsReadName(data, len, offset, r->name, BA_MAX_NAME_LEN, NULL);
     if (nameLen < 0)
         return BA_BADPARAM;
 
     /* Parse type, class, TTL, and RDATA length */
-    UBYTE *ptr = data + nameLen;
+    const UBYTE *ptr = data + offset + nameLen;
+    len -= offset;
     if (len - nameLen < 10)
         return BA_BADPARAM;
 
-    r->type = ntohs(*(UWORD *)ptr);
-    r->class = ntohs(*(UWORD *)(ptr + 2));
-    r->ttl = ntohl(*(ULONG *)(ptr + 4));
-    r->rdlength = ntohs(*(UWORD *)(ptr + 8));
+    r->type = getWord(ptr);
+    r->class = getWord(ptr + 2);
+    r->ttl = getLong(ptr + 4);
+    r->rdlength = getWord(ptr + 8);
 
     /* Validate type and class */
     if (r->type != DNS_TYPE_A && 
@@ -151,7 +196,8 @@ LONG dnsParseRecord(const UBYTE *data, LONG len, struct DNSRecord *r)
         r->type != DNS_TYPE_SRV)
         return BA_BADPARAM;
 
-    if (r->class != DNS_CLASS_IN)
+    /* The top bit is the mDNS cache-flush flag */
+    if ((r->class & DNS_CLASS_MASK) != DNS_CLASS_IN)
         return BA_BADPARAM;
 
     /* Validate TTL */
@@ -162,7 +208,7 @@ LONG dnsParseRecord(const UBYTE *data, LONG len, struct DNSRecord *r)
     if (len - nameLen - 10 < r->rdlength)
         return BA_BADPARAM;
 
-    r->rdata = ptr + 10;
+    r->rdata = (UBYTE *)ptr + 10;
 
     /* Validate RDATA based on type */
     switch (r->type) {
@@ -190,6 +236,545 @@ LONG dnsParseRecord(const UBYTE *data, LONG len, struct DNSRecord *r)
     return nameLen + 10 + r->rdlength;
 }
 
+/* Length of the name stored at offset up to its root label or first
+ * compression pointer, -1 if it runs past end. Pointers are not followed;
+ * dnsReadName checks them when the name is actually decoded. Without
+ * pointers set, only plain labels ending in the root label are accepted. */
+static LONG storedNameLength(const UBYTE *data, LONG end, LONG offset, BOOL pointers)
+{
+    LONG p = offset;
+
+    while (p < end) {
+        if ((data[p] & 0xC0) == 0xC0) {
+            if (!pointers)
+                return -1;
+            return (p + 2 <= end) ? p + 2 - offset : -1;
+        }
+        if (data[p] & 0xC0)
+            return -1;
+        if (data[p] == 0)
+            return p + 1 - offset;
+        p += data[p] + 1;
+    }
+
+    return -1;
+}
+
+/* Start walking the RDATA at rdoffset in a packet.
+ * For records built locally pass the RDATA itself with rdoffset 0. */
+LONG dnsRDataInit(struct DNSRDataIter *iter, const UBYTE *data, LONG len,
+                  LONG rdoffset, UWORD rdlength, UWORD type)
+{
+    LONG n;
+
+    if (!iter || !data || rdoffset < 0 || rdoffset + rdlength > len)
+        return BA_BADPARAM;
+
+    iter->data = data;
+    iter->len = len;
+    iter->pos = rdoffset;
+    iter->end = rdoffset + rdlength;
+    iter->next = -1;
+    iter->type = type;
+
+    /* NSEC starts with the next domain name, every window repeats it */
+    if (type == DNS_TYPE_NSEC) {
+        n = storedNameLength(data, iter->end, iter->pos, TRUE);
+        if (n < 0)
+            return -1;
+        iter->next = iter->pos;
+        iter->pos += n;
+    }
+
+    return 0;
+}
+
+/* Start walking the RDATA of a parsed record */
+LONG dnsEntryRData(const struct DNSMessage *msg, const struct DNSEntry *entry,
+                   struct DNSRDataIter *iter)
+{
+    if (!msg || !entry || entry->section == DNS_SECTION_QUESTION)
+        return BA_BADPARAM;
+
+    return dnsRDataInit(iter, msg->data, msg->length, entry->rdoffset,
+                        entry->rdlength, entry->type);
+}
+
+/* Yield the next RDATA item: 1 for an item, 0 at the end, -1 if malformed */
+LONG dnsRDataNext(struct DNSRDataIter *iter, struct DNSRData *rd)
+{
+    const UBYTE *p;
+    LONG left;
+    LONG n;
+
+    if (!iter || !rd)
+        return BA_BADPARAM;
+
+    left = iter->end - iter->pos;
+    if (left <= 0)
+        return 0;
+
+    p = iter->data + iter->pos;
+    memset(rd, 0, sizeof(*rd));
+    rd->type = iter->type;
+    rd->name = -1;
+
+    switch (iter->type) {
+        case DNS_TYPE_A:
+        case DNS_TYPE_AAAA:
+            if (left != (iter->type == DNS_TYPE_A ? 4 : 16))
+                return -1;
+            rd->data = p;
+            rd->length = left;
+            break;
+
+        case DNS_TYPE_PTR:
+            if (storedNameLength(iter->data, iter->end, iter->pos, TRUE) != left)
+                return -1;
+            rd->name = iter->pos;
+            break;
+
+        case DNS_TYPE_SRV:
+            if (left < 7 ||
+                storedNameLength(iter->data, iter->end, iter->pos + 6, TRUE) != left - 6)
+                return -1;
+            rd->priority = getWord(p);
+            rd->weight = getWord(p + 2);
+            rd->port = getWord(p + 4);
+            rd->name = iter->pos + 6;
+            break;
+
+        case DNS_TYPE_TXT:
+            n = p[0];
+            if (1 + n > left)
+                return -1;
+            rd->data = p + 1;
+            rd->length = n;
+            iter->pos += 1 + n;
+            return 1;
+
+        case DNS_TYPE_NSEC:
+            if (left < 2 || p[1] == 0 || p[1] > 32 || 2 + p[1] > left)
+                return -1;
+            rd->name = iter->next;
+            rd->window = p[0];
+            rd->data = p + 2;
+            rd->length = p[1];
+            iter->pos += 2 + p[1];
+            return 1;
+
+        default:
+            rd->data = p;
+            rd->length = left;
+            break;
+    }
+
+    iter->pos = iter->end;
+    return 1;
+}
+
+/* Check whether an NSEC window item lists a record type */
+BOOL dnsNSECHasType(const struct DNSRData *rd, UWORD type)
+{
+    UWORD bit = type & 0xFF;
+
+    if (!rd || rd->type != DNS_TYPE_NSEC || rd->window != (type >> 8) ||
+        (bit >> 3) >= rd->length)
+        return FALSE;
+
+    return (rd->data[bit >> 3] & (0x80 >> (bit & 7))) != 0;
+}
+
+/* Compare the RDATA of a parsed record with uncompressed wire RDATA.
+ * PTR and SRV targets may be compressed in the packet and are compared
+ * as names, case-insensitively; other types byte for byte. */
+BOOL dnsEntryRDataEqual(struct DNSMessage *msg, const struct DNSEntry *entry,
+                        const UBYTE *rdata, UWORD rdlength)
+{
+    char target[BA_MAX_NAME_LEN];
+    UBYTE labels[BA_MAX_NAME_LEN];
+    LONG prefix;
+    LONG n;
+
+    if (!msg || !entry || !rdata || entry->section == DNS_SECTION_QUESTION)
+        return FALSE;
+
+    if (entry->type != DNS_TYPE_PTR && entry->type != DNS_TYPE_SRV)
+        return entry->rdlength == rdlength &&
+               memcmp(msg->data + entry->rdoffset, rdata, rdlength) == 0;
+
+    /* SRV priority, weight and port come before the target */
+    prefix = (entry->type == DNS_TYPE_SRV) ? 6 : 0;
+    if (entry->rdlength <= prefix || rdlength <= prefix ||
+        memcmp(msg->data + entry->rdoffset, rdata, prefix) != 0)
+        return FALSE;
+
+    if (dnsReadName(msg->data, msg->length, entry->rdoffset + prefix, target,
+                    sizeof(target), &msg->names) < 0)
+        return FALSE;
+
+    n = dnsNameToLabels(target, labels, sizeof(labels));
+    return n == rdlength - prefix && dnsCaseEqual(labels, rdata + prefix, n);
+}
+
+/* Store a 16-bit value in network byte order */
+static void putWord(UBYTE *p, UWORD value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+/* Store a 32-bit value in network byte order */
+static void putLong(UBYTE *p, ULONG value)
+{
+    p[0] = value >> 24;
+    p[1] = (value >> 16) & 0xFF;
+    p[2] = (value >> 8) & 0xFF;
+    p[3] = value & 0xFF;
+}
+
+/* Build a DNS message header */
+LONG dnsBuildMessage(UBYTE *buffer, LONG buflen, const struct DNSHeader *header)
+{
+    if (!buffer || !header || buflen < DNS_HEADER_SIZE)
+        return BA_BADPARAM;
+
+    putWord(buffer, header->id);
+    buffer[2] = header->flags1;
+    buffer[3] = header->flags2;
+    putWord(buffer + 4, header->qdcount);
+    putWord(buffer + 6, header->ancount);
+    putWord(buffer + 8, header->nscount);
+    putWord(buffer + 10, header->arcount);
+
+    return DNS_HEADER_SIZE;
+}
+
+/* Case folding follows RFC 6762 section 16: only the ASCII capitals A-Z
+ * fold, every other byte must match exactly. Names are compared a ULONG
+ * at a time, the bytes of a word are folded in parallel. */
+#define SWAR_ONES ((ULONG)~0UL / 0xFF)    /* 0x01 in every byte */
+#define SWAR_HIGH (SWAR_ONES * 0x80)      /* 0x80 in every byte */
+
+/* Fold an ASCII letter to lower case, other bytes are left alone */
+static UBYTE foldCase(UBYTE c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* Fold every ASCII capital in a word to lower case */
+static ULONG foldWord(ULONG w)
+{
+    ULONG low = w & ~SWAR_HIGH;                 /* Bytes without bit 7 */
+    ULONG geA = low + SWAR_ONES * (0x80 - 'A'); /* Bit 7 set where >= 'A' */
+    ULONG gtZ = low + SWAR_ONES * (0x7F - 'Z'); /* Bit 7 set where > 'Z' */
+    ULONG upper = (geA ^ gtZ) & ~w & SWAR_HIGH;
+
+    return w | (upper >> 2);                    /* 0x80 >> 2 is the case bit */
+}
+
+/* Compare two byte runs ignoring ASCII case. Label length bytes are below
+ * 'A', so whole uncompressed label sequences can be compared in one go. */
+BOOL dnsCaseEqual(const UBYTE *a, const UBYTE *b, LONG len)
+{
+    ULONG wa, wb;
+
+    /* memcpy keeps the loads safe on the 68000 for odd addresses */
+    while (len >= (LONG)sizeof(ULONG)) {
+        memcpy(&wa, a, sizeof(ULONG));
+        memcpy(&wb, b, sizeof(ULONG));
+        if (wa != wb && foldWord(wa) != foldWord(wb))
+            return FALSE;
+        a += sizeof(ULONG);
+        b += sizeof(ULONG);
+        len -= sizeof(ULONG);
+    }
+
+    while (len-- > 0) {
+        if (*a != *b && foldCase(*a) != foldCase(*b))
+            return FALSE;
+        a++;
+        b++;
+    }
+
+    return TRUE;
+}
+
+/* Copy a byte run folding ASCII capitals to lower case */
+void dnsFoldCase(UBYTE *dst, const UBYTE *src, LONG len)
+{
+    ULONG w;
+
+    while (len >= (LONG)sizeof(ULONG)) {
+        memcpy(&w, src, sizeof(ULONG));
+        w = foldWord(w);
+        memcpy(dst, &w, sizeof(ULONG));
+        src += sizeof(ULONG);
+        dst += sizeof(ULONG);
+        len -= sizeof(ULONG);
+    }
+
+    while (len-- > 0)
+        *dst++ = foldCase(*src++);
+}
+
+/* Compare two dotted names ignoring ASCII case */
+BOOL dnsNameEqual(const char *a, const char *b)
+{
+    LONG len = strlen(a);
+
+    if ((LONG)strlen(b) != len)
+        return FALSE;
+
+    return dnsCaseEqual((const UBYTE *)a, (const UBYTE *)b, len);
+}
+
+/* Check whether a dotted name ends in the given labels, e.g. "local".
+ * The match must start on a label boundary; a trailing dot is ignored. */
+BOOL dnsNameHasSuffix(const char *name, const char *suffix)
+{
+    LONG nlen = strlen(name);
+    LONG slen = strlen(suffix);
+
+    if (nlen > 0 && name[nlen - 1] == '.')
+        nlen--;
+    if (slen > nlen)
+        return FALSE;
+    if (slen < nlen && name[nlen - slen - 1] != '.')
+        return FALSE;
+
+    return dnsCaseEqual((const UBYTE *)name + nlen - slen, (const UBYTE *)suffix, slen);
+}
+
+/* Check whether an uncompressed label sequence ends in another one */
+BOOL dnsLabelsHaveSuffix(const UBYTE *labels, const UBYTE *suffix)
+{
+    const UBYTE *p;
+    LONG nlen, slen;
+
+    for (p = labels; *p; p += *p + 1);
+    nlen = p - labels + 1;
+    for (p = suffix; *p; p += *p + 1);
+    slen = p - suffix + 1;
+
+    /* Step label by label until the remainder is the suffix's length */
+    for (p = labels; nlen > slen; p += *p + 1)
+        nlen -= *p + 1;
+
+    return nlen == slen && dnsCaseEqual(p, suffix, slen);
+}
+
+/* Check whether the name at a packet offset equals an uncompressed
+ * label sequence, following compression pointers in the packet */
+static BOOL nameMatches(const UBYTE *base, UWORD offset, const UBYTE *labels)
+{
+    const UBYTE *p = base + offset;
+    LONG hops = 0;
+
+    for (;;) {
+        while ((*p & 0xC0) == 0xC0) {
+            if (++hops > DNS_MAX_POINTER_HOPS)
+                return FALSE;
+            p = base + (((p[0] & 0x3F) << 8) | p[1]);
+        }
+
+        if (*p != *labels)
+            return FALSE;
+        if (*p == 0)
+            return TRUE;
+
+        UBYTE labelLen = *p;
+        if (!dnsCaseEqual(p + 1, labels + 1, labelLen))
+            return FALSE;
+        p += labelLen + 1;
+        labels += labelLen + 1;
+    }
+}
+
+/* Start an empty compression table for the packet at base */
+void dnsInitNameTable(struct DNSNameTable *names, const UBYTE *base)
+{
+    names->base = base;
+    names->count = 0;
+}
+
+/* Write an uncompressed label sequence, replacing the longest suffix
+ * already present in the packet with a compression pointer */
+LONG dnsWriteLabels(UBYTE *buffer, LONG buflen, const UBYTE *labels,
+                    struct DNSNameTable *names)
+{
+    if (!buffer || !labels)
+        return -1;
+
+    /* Find the first label whose suffix is already in the packet */
+    LONG pos = 0;
+    LONG target = -1;
+    if (names) {
+        while (labels[pos] != 0 && target < 0) {
+            for (UWORD n = 0; n < names->count; n++) {
+                if (nameMatches(names->base, names->offsets[n], labels + pos)) {
+                    target = names->offsets[n];
+                    break;
+                }
+            }
+            if (target < 0)
+                pos += labels[pos] + 1;
+        }
+    } else {
+        while (labels[pos] != 0)
+            pos += labels[pos] + 1;
+    }
+
+    /* Copy the labels before the match, then a pointer or the root label */
+    LONG len = pos + (target >= 0 ? 2 : 1);
+    if (len > buflen)
+        return -1;
+
+    memcpy(buffer, labels, pos);
+    if (target >= 0) {
+        buffer[pos] = 0xC0 | (target >> 8);
+        buffer[pos + 1] = target & 0xFF;
+    } else {
+        buffer[pos] = 0;
+    }
+
+    /* Remember the labels we wrote out as future pointer targets */
+    if (names) {
+        LONG start = buffer - names->base;
+        LONG k = 0;
+        while (k < pos && names->count < DNS_MAX_COMPRESS &&
+               start + k <= DNS_MAX_POINTER_OFFSET) {
+            names->offsets[names->count++] = start + k;
+            k += labels[k] + 1;
+        }
+    }
+
+    return len;
+}
+
+/* Convert a domain name to DNS labels, compressed against the packet */
+LONG dnsWriteName(UBYTE *buffer, LONG buflen, const char *name,
+                  struct DNSNameTable *names)
+{
+    UBYTE labels[BA_MAX_NAME_LEN];
+
+    if (dnsNameToLabels(name, labels, sizeof(labels)) < 0)
+        return -1;
+
+    return dnsWriteLabels(buffer, buflen, labels, names);
+}
+
+/* Build a DNS question */
+LONG dnsBuildQuestion(UBYTE *buffer, LONG buflen, const struct DNSQuestion *q,
+                      struct DNSNameTable *names)
+{
+    if (!buffer || !q || !q->qname)
+        return BA_BADPARAM;
+
+    /* Encode name */
+    LONG nameLen = dnsWriteName(buffer, buflen, q->qname, names);
+    if (nameLen < 0)
+        return BA_BADPARAM;
+
+    /* Encode type and class */
+    if (buflen - nameLen < 4)
+        return BA_BADPARAM;
+
+    putWord(buffer + nameLen, q->qtype);
+    putWord(buffer + nameLen + 2, q->qclass);
+
+    return nameLen + 4;
+}
+
+/* Build a DNS record, RDATA must already be in wire format.
+ * Names inside PTR and SRV RDATA are compressed as well (RFC 6762 18.14). */
+LONG dnsBuildRecord(UBYTE *buffer, LONG buflen, const struct DNSRecord *r,
+                    struct DNSNameTable *names)
+{
+    if (!buffer || !r || !r->name || (r->rdlength && !r->rdata))
+        return BA_BADPARAM;
+
+    /* Encode name */
+    LONG nameLen = dnsWriteName(buffer, buflen, r->name, names);
+    if (nameLen < 0)
+        return BA_BADPARAM;
+
+    /* Encode type, class and TTL */
+    if (buflen - nameLen < 10)
+        return BA_BADPARAM;
+
+    UBYTE *ptr = buffer + nameLen;
+    LONG room = buflen - nameLen - 10;
+    LONG rdlength;
+    putWord(ptr, r->type);
+    putWord(ptr + 2, r->class);
+    putLong(ptr + 4, r->ttl);
+
+    /* Encode RDATA */
+    if (names && r->type == DNS_TYPE_PTR && r->rdlength > 0) {
+        rdlength = dnsWriteLabels(ptr + 10, room, r->rdata, names);
+    } else if (names && r->type == DNS_TYPE_SRV && r->rdlength > 6) {
+        if (room < 6)
+            return BA_BADPARAM;
+        memcpy(ptr + 10, r->rdata, 6);
+        rdlength = dnsWriteLabels(ptr + 16, room - 6, r->rdata + 6, names);
+        if (rdlength >= 0)
+            rdlength += 6;
+    } else {
+        rdlength = r->rdlength <= room ? r->rdlength : -1;
+        if (rdlength >= 0)
+            memcpy(ptr + 10, r->rdata, rdlength);
+    }
+    if (rdlength < 0)
+        return BA_BADPARAM;
+
+    putWord(ptr + 8, rdlength);
+
+    return nameLen + 10 + rdlength;
+}
+
+/* Build the restricted NSEC form mDNS uses for negative answers
+ * (RFC 6762 6.1): the next name is the owner name itself and only the
+ * first bitmap window is present, so types above 255 cannot be listed */
+LONG dnsBuildNSEC(UBYTE *buffer, LONG buflen, const char *name, UWORD class,
+                  ULONG ttl, const UWORD *types, LONG numTypes)
+{
+    struct DNSRecord r;
+    UBYTE rdata[BA_MAX_NAME_LEN + 2 + 32];
+    UBYTE *bitmap;
+    LONG bytes = 0;
+    LONG i;
+
+    if (!name || (numTypes && !types))
+        return BA_BADPARAM;
+
+    LONG nameLen = dnsNameToLabels(name, rdata, BA_MAX_NAME_LEN);
+    if (nameLen < 0)
+        return BA_BADPARAM;
+
+    /* Window 0, sized to the highest type present */
+    bitmap = rdata + nameLen + 2;
+    memset(bitmap, 0, 32);
+    for (i = 0; i < numTypes; i++) {
+        if (types[i] > 255)
+            continue;
+        bitmap[types[i] >> 3] |= 0x80 >> (types[i] & 7);
+        if ((types[i] >> 3) + 1 > bytes)
+            bytes = (types[i] >> 3) + 1;
+    }
+    rdata[nameLen] = 0;
+    rdata[nameLen + 1] = bytes;
+
+    r.name = (char *)name;
+    r.type = DNS_TYPE_NSEC;
+    r.class = class;
+    r.ttl = ttl;
+    r.rdlength = nameLen + 2 + bytes;
+    r.rdata = rdata;
+
+    return dnsBuildRecord(buffer, buflen, &r, NULL);
+}
+
 /* Convert a domain name to DNS labels */
 LONG dnsNameToLabels(const char *name, UBYTE *buffer, LONG buflen)
 {
@@ -201,6 +786,8 @@ LONG dnsNameToLabels(const char *name, UBYTE *buffer, LONG buflen)
 
     while (*name) {
         if (*name == '.') {
+            if (name == start || name - start > 63)
+                return -1;
             if (pos + (name - start) + 1 > buflen)
                 return -1;
             buffer[pos++] = name - start;
@@ -211,51 +798,146 @@ LONG dnsNameToLabels(const char *name, UBYTE *buffer, LONG buflen)
         name++;
     }
 
-    if (pos + (name - start) + 2 > buflen)
+    if (name - start > 63)
         return -1;
 
-    buffer[pos++] = name - start;
-    memcpy(buffer + pos, start, name - start);
-    pos += name - start;
+    /* Last label, absent when the name ends in a dot */
+    if (name != start) {
+        if (pos + (name - start) + 2 > buflen)
+            return -1;
+        buffer[pos++] = name - start;
+        memcpy(buffer + pos, start, name - start);
+        pos += name - start;
+    } else if (pos + 1 > buflen) {
+        return -1;
+    }
     buffer[pos++] = 0;
 
     return pos;
 }
 
-/* Convert DNS labels to a domain name */
-LONG dnsLabelsToName(const UBYTE *labels, LONG len, char *name, LONG namelen)
+/* Forget all suffixes remembered for the previous packet */
+void dnsInitNameCache(struct DNSNameCache *cache)
 {
-    if (!labels || !name || len <= 0 || namelen <= 0)
-        return -1;
+    memset(cache->slots, 0, sizeof(cache->slots));
+    cache->used = 0;
+}
 
+/* Decode the name at offset within a message.
+ * Compression pointers are resolved against data and limited to
+ * DNS_MAX_POINTER_HOPS. Returns the number of bytes the name occupies at
+ * offset, up to and including its terminating zero or first pointer.
+ * With a cache, every label position decoded is remembered together with
+ * its dotted suffix, so later names ending in the same labels stop at the
+ * first label already seen. */
+LONG dnsReadName(const UBYTE *data, LONG len, LONG offset, char *name, LONG namelen,
+                 struct DNSNameCache *cache)
+{
+    UWORD labelOffset[DNS_MAX_LABELS];  /* Packet offset of each label decoded */
+    UWORD labelText[DNS_MAX_LABELS];    /* Its position in name */
+    UWORD labelEnd[DNS_MAX_LABELS];     /* End of the inline run it belongs to */
+    LONG numLabels = 0;
+    LONG runStart = 0;
+    LONG consumed = -1;
+    LONG hops = 0;
     LONG pos = 0;
-    LONG labelLen;
+    LONG p = offset;
+    LONG k;
 
-    while ((labelLen = *labels) != 0) {
-        if (labelLen & 0xC0) {
-            /* Handle compression */
-            UWORD offset = ((labelLen & 0x3F) << 8) | labels[1];
-            if (offset >= len)
+    if (!data || !name || offset < 0 || offset >= len || namelen <= 0)
+        return -1;
+
+    for (;;) {
+        if (p >= len)
+            return -1;
+
+        UBYTE labelLen = data[p];
+
+        /* Compression pointer, ends the current run */
+        if ((labelLen & 0xC0) == 0xC0) {
+            if (p + 1 >= len || ++hops > DNS_MAX_POINTER_HOPS)
                 return -1;
-            labels = labels + offset;
+            for (k = runStart; k < numLabels; k++)
+                labelEnd[k] = p + 2;
+            runStart = numLabels;
+            if (consumed < 0)
+                consumed = p + 2 - offset;
+            p = ((labelLen & 0x3F) << 8) | data[p + 1];
             continue;
         }
 
-        if (pos + labelLen + 1 > namelen)
+        /* Extended label types are not used by mDNS */
+        if (labelLen & 0xC0)
+            return -1;
+
+        /* Root label */
+        if (labelLen == 0) {
+            for (k = runStart; k < numLabels; k++)
+                labelEnd[k] = p + 1;
+            if (consumed < 0)
+                consumed = p + 1 - offset;
+            if (pos > 0)
+                pos--;      /* Drop the trailing dot */
+            name[pos] = 0;
+            break;
+        }
+
+        /* Suffix already decoded from this packet */
+        if (cache) {
+            struct DNSNameSlot *slot = &cache->slots[p & (DNS_NAME_CACHE_SLOTS - 1)];
+            if (slot->length && slot->offset == p) {
+                if (pos + slot->length + 1 > namelen)
+                    return -1;
+                memcpy(name + pos, cache->text + slot->text, slot->length);
+                pos += slot->length;
+                name[pos] = 0;
+                for (k = runStart; k < numLabels; k++)
+                    labelEnd[k] = p + slot->wire;
+                if (consumed < 0)
+                    consumed = p + slot->wire - offset;
+                break;
+            }
+        }
+
+        if (p + 1 + labelLen > len || pos + labelLen + 1 > namelen)
             return -1;
 
-        memcpy(name + pos, labels + 1, labelLen);
+        if (numLabels < DNS_MAX_LABELS) {
+            labelOffset[numLabels] = p;
+            labelText[numLabels] = pos;
+            numLabels++;
+        }
+
+        memcpy(name + pos, data + p + 1, labelLen);
         pos += labelLen;
         name[pos++] = '.';
-        labels += labelLen + 1;
+        p += labelLen + 1;
+    }
+
+    /* Remember the suffix at every label we decoded */
+    if (cache && numLabels > 0 && cache->used + pos <= DNS_NAME_CACHE_SIZE) {
+        UWORD base = cache->used;
+        memcpy(cache->text + base, name, pos);
+        cache->used += pos;
+        for (k = 0; k < numLabels; k++) {
+            struct DNSNameSlot *slot =
+                &cache->slots[labelOffset[k] & (DNS_NAME_CACHE_SLOTS - 1)];
+            slot->offset = labelOffset[k];
+            slot->wire = labelEnd[k] - labelOffset[k];
+            slot->text = base + labelText[k];
+            slot->length = pos - labelText[k];
+        }
     }
 
-    if (pos > 0)
-        name[pos - 1] = 0;
-    else
-        name[0] = 0;
+    return consumed;
+}
 
-    return labels - labels + 1;
+/* Convert DNS labels to a domain name.
+ * Compression pointers are taken relative to labels, so pass the start of
+ * the message; use dnsReadName for names elsewhere in a packet. */
+LONG dnsLabelsToName(const UBYTE *labels, LONG len, char *name, LONG namelen)
+{
+    return dnsReadName(labels, len, 0, name, namelen, NULL);
 }
 
 /* Skip a DNS name in a message */
@@ -272,7 +954,7 @@ UBYTE *dnsSkipName(const UBYTE *data, LONG len)
             /* Handle compression */
             if (pos + 1 >= len)
                 return NULL;
-            return data + pos + 2;
+            return (UBYTE *)data + pos + 2;
         }
 
         if (pos + labelLen + 1 >= len)
@@ -281,5 +963,242 @@ UBYTE *dnsSkipName(const UBYTE *data, LONG len)
         pos += labelLen + 1;
     }
 
-    return data + pos + 1;
-} 
\ No newline at end of file
+    return (UBYTE *)data + pos + 1;
+} 
+
+/* Start a writer. flags1 carries QR/AA for responses, 0 for queries. */
+void dnsWriterInit(struct DNSPacketWriter *writer, UBYTE *buffer, LONG budget,
+                   UBYTE flags1, DNSFlushFunc flush, APTR userData)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->buffer = buffer;
+    writer->budget = budget;
+    writer->length = DNS_HEADER_SIZE;
+    writer->header.flags1 = flags1 & ~DNS_FLAG_TC;
+    writer->section = DNS_SECTION_QUESTION;
+    writer->flush = flush;
+    writer->userData = userData;
+    dnsInitNameTable(&writer->names, buffer);
+}
+
+/* Number of entries in the packet being built */
+static LONG writerCount(const struct DNSPacketWriter *writer)
+{
+    const struct DNSHeader *h = &writer->header;
+
+    return h->qdcount + h->ancount + h->nscount + h->arcount;
+}
+
+/* Hand the packet over with the given extra flags and start a new one */
+static LONG writerEmit(struct DNSPacketWriter *writer, UBYTE flags)
+{
+    UBYTE flags1 = writer->header.flags1;
+    LONG result = 0;
+
+    if (writerCount(writer) > 0) {
+        writer->header.flags1 |= flags;
+        dnsBuildMessage(writer->buffer, DNS_HEADER_SIZE, &writer->header);
+        if (writer->flush)
+            result = writer->flush(writer->buffer, writer->length, writer->userData);
+        writer->packets++;
+    }
+
+    writer->header.flags1 = flags1;
+    writer->header.qdcount = 0;
+    writer->header.ancount = 0;
+    writer->header.nscount = 0;
+    writer->header.arcount = 0;
+    writer->length = DNS_HEADER_SIZE;
+    writer->section = DNS_SECTION_QUESTION;
+    dnsInitNameTable(&writer->names, writer->buffer);
+
+    return result;
+}
+
+/* Start a new packet because the next item, for section, does not fit.
+ * TC is only for a query whose known answers go on in the next packet
+ * (RFC 6762 7.2); split probes and multicast responses never carry it
+ * (RFC 6762 18.5). */
+static LONG writerSplit(struct DNSPacketWriter *writer, UBYTE section)
+{
+    BOOL knownAnswers = !(writer->header.flags1 & DNS_FLAG_QR) &&
+                        section == DNS_SECTION_ANSWER;
+
+    return writerEmit(writer, knownAnswers ? DNS_FLAG_TC : 0);
+}
+
+/* Copy a record already in wire form, see dnsWriterAddWire. The owner
+ * name and PTR/SRV targets are compressed against the packet, everything
+ * else is copied as it is. */
+LONG dnsCopyRecord(UBYTE *buffer, LONG buflen, const UBYTE *wire, LONG length,
+                   struct DNSNameTable *names)
+{
+    if (!buffer || !wire)
+        return BA_BADPARAM;
+
+    /* Owner labels, then type, class, TTL, RDLENGTH and RDATA */
+    LONG ownerLen = storedNameLength(wire, length, 0, FALSE);
+    if (ownerLen < 0 || length < ownerLen + 10)
+        return BA_BADPARAM;
+
+    const UBYTE *fixed = wire + ownerLen;
+    UWORD type = getWord(fixed);
+    LONG rdsize = getWord(fixed + 8);
+    if (ownerLen + 10 + rdsize != length)
+        return BA_BADPARAM;
+
+    LONG nameLen = dnsWriteLabels(buffer, buflen, wire, names);
+    if (nameLen < 0 || buflen - nameLen < 10)
+        return BA_BADPARAM;
+
+    UBYTE *ptr = buffer + nameLen;
+    LONG room = buflen - nameLen - 10;
+    const UBYTE *rdata = fixed + 10;
+    LONG rdlength;
+    memcpy(ptr, fixed, 8);
+
+    /* Target names must be plain labels filling the rest of the RDATA */
+    if (type == DNS_TYPE_PTR || type == DNS_TYPE_SRV) {
+        LONG start = (type == DNS_TYPE_SRV) ? 6 : 0;
+        LONG targetLen = storedNameLength(rdata, rdsize, start, FALSE);
+        if (targetLen < 0 || start + targetLen != rdsize)
+            return BA_BADPARAM;
+    }
+
+    if (names && type == DNS_TYPE_PTR && rdsize > 0) {
+        rdlength = dnsWriteLabels(ptr + 10, room, rdata, names);
+    } else if (names && type == DNS_TYPE_SRV && rdsize > 6) {
+        if (room < 6)
+            return BA_BADPARAM;
+        memcpy(ptr + 10, rdata, 6);
+        rdlength = dnsWriteLabels(ptr + 16, room - 6, rdata + 6, names);
+        if (rdlength >= 0)
+            rdlength += 6;
+    } else {
+        rdlength = rdsize <= room ? rdsize : -1;
+        if (rdlength >= 0)
+            memcpy(ptr + 10, rdata, rdlength);
+    }
+    if (rdlength < 0)
+        return BA_BADPARAM;
+
+    putWord(ptr + 8, rdlength);
+
+    return nameLen + 10 + rdlength;
+}
+
+/* Append one question or record, splitting the packet when needed.
+ * Records come either as a DNSRecord or already in wire form. */
+static LONG writerAppend(struct DNSPacketWriter *writer, UBYTE section,
+                         const struct DNSQuestion *q, const struct DNSRecord *r,
+                         const UBYTE *wire, LONG wireLength)
+{
+    UWORD *count[4];
+    UWORD saved;
+    LONG result;
+    LONG n;
+
+    if (!writer || !writer->buffer || section > DNS_SECTION_ADDITIONAL)
+        return BA_BADPARAM;
+
+    count[DNS_SECTION_QUESTION] = &writer->header.qdcount;
+    count[DNS_SECTION_ANSWER] = &writer->header.ancount;
+    count[DNS_SECTION_AUTHORITY] = &writer->header.nscount;
+    count[DNS_SECTION_ADDITIONAL] = &writer->header.arcount;
+
+    /* Sections are laid out in order, going back needs a new packet */
+    if (section < writer->section) {
+        result = writerEmit(writer, 0);
+        if (result < 0)
+            return result;
+    }
+
+    for (;;) {
+        saved = writer->names.count;
+        if (q)
+            n = dnsBuildQuestion(writer->buffer + writer->length,
+                                 writer->budget - writer->length, q, &writer->names);
+        else if (r)
+            n = dnsBuildRecord(writer->buffer + writer->length,
+                               writer->budget - writer->length, r, &writer->names);
+        else
+            n = dnsCopyRecord(writer->buffer + writer->length,
+                              writer->budget - writer->length, wire, wireLength,
+                              &writer->names);
+        if (n >= 0)
+            break;
+
+        /* Forget targets from the failed attempt */
+        writer->names.count = saved;
+
+        /* Too big even for an empty packet */
+        if (writerCount(writer) == 0)
+            return n;
+
+        result = writerSplit(writer, section);
+        if (result < 0)
+            return result;
+    }
+
+    /* Legacy unicast responses carry short TTLs (RFC 6762 6.7) */
+    if (!q && writer->maxTTL) {
+        UBYTE *record = writer->buffer + writer->length;
+        LONG owner = storedNameLength(record, n, 0, TRUE);
+        if (owner >= 0 && getLong(record + owner + 4) > writer->maxTTL)
+            putLong(record + owner + 4, writer->maxTTL);
+    }
+
+    writer->length += n;
+    writer->section = section;
+    (*count[section])++;
+
+    return n;
+}
+
+/* Append a question */
+LONG dnsWriterAddQuestion(struct DNSPacketWriter *writer, const struct DNSQuestion *q)
+{
+    if (!q)
+        return BA_BADPARAM;
+
+    return writerAppend(writer, DNS_SECTION_QUESTION, q, NULL, NULL, 0);
+}
+
+/* Append a record to the answer, authority or additional section */
+LONG dnsWriterAddRecord(struct DNSPacketWriter *writer, UBYTE section,
+                        const struct DNSRecord *r)
+{
+    if (!r || section == DNS_SECTION_QUESTION)
+        return BA_BADPARAM;
+
+    return writerAppend(writer, section, NULL, r, NULL, 0);
+}
+
+/* Append a record rendered once by dnsBuildRecord without a name table */
+LONG dnsWriterAddWire(struct DNSPacketWriter *writer, UBYTE section,
+                      const UBYTE *wire, LONG length)
+{
+    if (!wire || section == DNS_SECTION_QUESTION)
+        return BA_BADPARAM;
+
+    return writerAppend(writer, section, NULL, NULL, wire, length);
+}
+
+/* Bytes left in the packet being built. A record whose wire form is no
+ * longer than this is certain to fit without a split. */
+LONG dnsWriterRoom(const struct DNSPacketWriter *writer)
+{
+    if (!writer)
+        return 0;
+
+    return writer->budget - writer->length;
+}
+
+/* Send whatever is left in the current packet */
+LONG dnsWriterFlush(struct DNSPacketWriter *writer)
+{
+    if (!writer)
+        return BA_BADPARAM;
+
+    return writerEmit(writer, 0);
+}